@@ -0,0 +1,609 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "disk.h"
+
+#define cache_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* End of a list of entries */
+#define NO_ENTRY -1
+
+/* Cached copy of one disk block */
+struct cache_entry {
+	/* Disk block held by the entry */
+	size_t block;
+	/* Entry holds a block */
+	int valid;
+	/* Block was modified since it was read or written back */
+	int dirty;
+	/* Neighbours in the LRU list */
+	int prev;
+	int next;
+	/* Next entry in the same hash bucket */
+	int hnext;
+	/* Block content */
+	uint8_t *data;
+};
+
+/* Cache instance description */
+struct cache {
+	/* Cache was set up */
+	int ready;
+	/* Number of entries */
+	size_t nblocks;
+	/* Entries and their block contents */
+	struct cache_entry *entries;
+	uint8_t *data;
+	/* Hash buckets, indexed by block number */
+	int *buckets;
+	size_t nbuckets;
+	/* LRU list, most recently used entry at the head */
+	int head;
+	int tail;
+	/* Counters, updated atomically since some accesses skip the lock */
+	struct cache_stats stats;
+};
+
+static struct cache cache;
+
+/* Add n to counter field */
+#define cache_count(field, n) \
+	__atomic_fetch_add(&cache.stats.field, (n), __ATOMIC_RELAXED)
+
+/* Serializes accesses to the cache, which can come from several threads */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Owner of the disk's asynchronous queue, whose completions cannot be told
+apart between threads */
+static pthread_mutex_t cache_aio_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Hash bucket of a block, nbuckets is a power of two */
+static size_t cache_bucket(size_t block)
+{
+	return block & (cache.nbuckets - 1);
+}
+
+/* Returns the entry holding block, or NO_ENTRY if block is not cached */
+static int cache_lookup(size_t block)
+{
+	int e = cache.buckets[cache_bucket(block)];
+
+	while (e != NO_ENTRY && cache.entries[e].block != block)
+		e = cache.entries[e].hnext;
+
+	return e;
+}
+
+static void cache_hash_remove(int e)
+{
+	int *link = &cache.buckets[cache_bucket(cache.entries[e].block)];
+
+	while (*link != e)
+		link = &cache.entries[*link].hnext;
+	*link = cache.entries[e].hnext;
+}
+
+static void cache_hash_insert(int e)
+{
+	size_t b = cache_bucket(cache.entries[e].block);
+
+	cache.entries[e].hnext = cache.buckets[b];
+	cache.buckets[b] = e;
+}
+
+static void cache_lru_remove(int e)
+{
+	struct cache_entry *entry = &cache.entries[e];
+
+	if (entry->prev != NO_ENTRY)
+		cache.entries[entry->prev].next = entry->next;
+	else
+		cache.head = entry->next;
+
+	if (entry->next != NO_ENTRY)
+		cache.entries[entry->next].prev = entry->prev;
+	else
+		cache.tail = entry->prev;
+}
+
+/* Move entry to the head of the LRU list */
+static void cache_lru_touch(int e)
+{
+	if (cache.head == e)
+		return;
+
+	cache_lru_remove(e);
+	cache.entries[e].prev = NO_ENTRY;
+	cache.entries[e].next = cache.head;
+	cache.entries[cache.head].prev = e;
+	cache.head = e;
+}
+
+/* Write entry back to disk if it is dirty */
+static int cache_writeback(int e)
+{
+	struct cache_entry *entry = &cache.entries[e];
+
+	if (!entry->valid || !entry->dirty)
+		return 0;
+
+	if (block_write(entry->block, entry->data) == -1)
+		return -1;
+
+	entry->dirty = 0;
+	cache_count(writebacks, 1);
+
+	return 0;
+}
+
+/* Recycle the least recently used entry to hold block */
+static int cache_evict(size_t block)
+{
+	int e = cache.tail;
+	struct cache_entry *entry = &cache.entries[e];
+
+	if (entry->valid) {
+		if (cache_writeback(e) == -1)
+			return NO_ENTRY;
+		cache_hash_remove(e);
+		cache_count(evictions, 1);
+	}
+
+	entry->block = block;
+	entry->valid = 1;
+	entry->dirty = 0;
+	cache_hash_insert(e);
+	cache_lru_touch(e);
+
+	return e;
+}
+
+/* Write back every dirty block, lock held */
+static int cache_writeback_all(void)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < cache.nblocks; i++) {
+		if (cache_writeback(i) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Set up a cache of nblocks blocks, lock held */
+static int cache_setup(size_t nblocks)
+{
+	if (cache.ready) {
+		cache_error("cache already set up");
+		return -1;
+	}
+
+	memset(&cache, 0, sizeof(struct cache));
+	cache.nblocks = nblocks;
+	cache.head = NO_ENTRY;
+	cache.tail = NO_ENTRY;
+
+	if (nblocks) {
+		/* Keep chains short with at least two buckets per entry */
+		cache.nbuckets = 1;
+		while (cache.nbuckets < 2 * nblocks)
+			cache.nbuckets <<= 1;
+
+		cache.entries = calloc(nblocks, sizeof(struct cache_entry));
+		/* Aligned, so that write-backs suit BLOCK_DISK_DIRECT */
+		if (posix_memalign((void **)&cache.data, BLOCK_SIZE,
+				   nblocks * BLOCK_SIZE))
+			cache.data = NULL;
+		cache.buckets = malloc(cache.nbuckets * sizeof(int));
+		if (!cache.entries || !cache.data || !cache.buckets) {
+			cache_error("cannot allocate %zu blocks", nblocks);
+			free(cache.entries);
+			free(cache.data);
+			free(cache.buckets);
+			return -1;
+		}
+
+		for (size_t i = 0; i < cache.nbuckets; i++)
+			cache.buckets[i] = NO_ENTRY;
+
+		/* Chain every (invalid) entry in the LRU list */
+		for (size_t i = 0; i < nblocks; i++) {
+			cache.entries[i].data = cache.data + i * BLOCK_SIZE;
+			cache.entries[i].prev = (int)i - 1;
+			cache.entries[i].next =
+				(i + 1 < nblocks) ? (int)i + 1 : NO_ENTRY;
+		}
+		cache.head = 0;
+		cache.tail = nblocks - 1;
+	}
+
+	cache.ready = 1;
+
+	return 0;
+}
+
+int cache_init(size_t nblocks)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache_lock);
+	ret = cache_setup(nblocks);
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+int cache_destroy(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!cache.ready) {
+		pthread_mutex_unlock(&cache_lock);
+		cache_error("no cache set up");
+		return -1;
+	}
+
+	ret = cache_writeback_all();
+
+	free(cache.entries);
+	free(cache.data);
+	free(cache.buckets);
+	memset(&cache, 0, sizeof(struct cache));
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+int cache_flush(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&cache_lock);
+	ret = cache_writeback_all();
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+/* Read block from the cache, lock held */
+static int cache_read_block(size_t block, void *buf)
+{
+	int e;
+
+	e = cache_lookup(block);
+	if (e != NO_ENTRY) {
+		cache_count(hits, 1);
+		cache_lru_touch(e);
+		memcpy(buf, cache.entries[e].data, BLOCK_SIZE);
+		return 0;
+	}
+
+	cache_count(misses, 1);
+	e = cache_evict(block);
+	if (e == NO_ENTRY)
+		return -1;
+
+	if (block_read(block, cache.entries[e].data) == -1) {
+		cache_hash_remove(e);
+		cache.entries[e].valid = 0;
+		return -1;
+	}
+
+	memcpy(buf, cache.entries[e].data, BLOCK_SIZE);
+
+	return 0;
+}
+
+/* Write block to the cache, lock held */
+static int cache_write_block(size_t block, const void *buf)
+{
+	int e;
+
+	/* Whole blocks are written, so a miss needs no read from disk */
+	e = cache_lookup(block);
+	if (e != NO_ENTRY) {
+		cache_count(hits, 1);
+		cache_lru_touch(e);
+	} else {
+		cache_count(misses, 1);
+		e = cache_evict(block);
+		if (e == NO_ENTRY)
+			return -1;
+	}
+
+	memcpy(cache.entries[e].data, buf, BLOCK_SIZE);
+	cache.entries[e].dirty = 1;
+
+	return 0;
+}
+
+int cache_read(size_t block, void *buf)
+{
+	int ret;
+
+	/* Without entries, there is no state to protect */
+	if (!cache.nblocks) {
+		cache_count(misses, 1);
+		return block_read(block, buf);
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	ret = cache_read_block(block, buf);
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+int cache_write(size_t block, const void *buf)
+{
+	int ret;
+
+	if (!cache.nblocks) {
+		cache_count(misses, 1);
+		return block_write(block, buf);
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	ret = cache_write_block(block, buf);
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+/* Run requests one after the other, straight through the disk */
+static int cache_sync_run(struct block_aio *reqs, size_t nreqs)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < nreqs; i++) {
+		struct iovec iov = {
+			.iov_base = reqs[i].buf,
+			.iov_len = reqs[i].count * BLOCK_SIZE,
+		};
+
+		reqs[i].status = reqs[i].write ?
+			block_writev(reqs[i].block, &iov, 1) :
+			block_readv(reqs[i].block, &iov, 1);
+		if (reqs[i].status == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Run requests to completion, as many at a time as the disk accepts. Requests
+that could not be submitted keep the status they had */
+static int cache_aio_run(struct block_aio *reqs, size_t nreqs)
+{
+	struct block_aio *done[BLOCK_AIO_DEPTH];
+	size_t queued = 0;
+	size_t inflight = 0;
+	int ret = 0;
+
+	if (nreqs == 0)
+		return 0;
+
+	/* Rather than wait for the thread using the queue, do the I/O in this
+	one: the disk serves several threads at once */
+	if (pthread_mutex_trylock(&cache_aio_lock))
+		return cache_sync_run(reqs, nreqs);
+
+	while (queued < nreqs || inflight > 0) {
+		int n;
+
+		if (queued < nreqs) {
+			n = block_aio_submit(reqs + queued, nreqs - queued);
+			if (n == -1) {
+				/* Give up on the rest, but wait for what is queued */
+				ret = -1;
+				nreqs = queued;
+			} else {
+				queued += n;
+				inflight += n;
+			}
+		}
+
+		if (inflight == 0)
+			continue;
+
+		n = block_aio_reap(done, BLOCK_AIO_DEPTH, 1);
+		if (n == -1) {
+			ret = -1;
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			if (done[i]->status == -1)
+				ret = -1;
+		}
+		inflight -= n;
+	}
+
+	pthread_mutex_unlock(&cache_aio_lock);
+
+	return ret;
+}
+
+/* Add a clean copy of block to the cache, lock held */
+static void cache_insert(size_t block, const void *buf)
+{
+	int e = cache_evict(block);
+
+	if (e != NO_ENTRY)
+		memcpy(cache.entries[e].data, buf, BLOCK_SIZE);
+}
+
+int cache_read_runs(const struct block_aio *runs, size_t nruns)
+{
+	struct block_aio *reqs;
+	size_t nreqs = 0;
+	size_t total = 0;
+	int ret;
+
+	for (size_t r = 0; r < nruns; r++)
+		total += runs[r].count;
+	if (total == 0)
+		return 0;
+
+	/* Worst case, every other block is cached */
+	reqs = calloc(total, sizeof(struct block_aio));
+	if (!reqs) {
+		cache_error("cannot allocate %zu requests", total);
+		return -1;
+	}
+
+	pthread_mutex_lock(&cache_lock);
+	for (size_t r = 0; r < nruns; r++) {
+		uint8_t *dst = runs[r].buf;
+		size_t block = runs[r].block;
+		size_t count = runs[r].count;
+		size_t i = 0;
+
+		while (i < count) {
+			size_t miss = 0;
+			int e;
+
+			/* Copy out cached blocks */
+			if (cache.nblocks &&
+			    (e = cache_lookup(block + i)) != NO_ENTRY) {
+				cache_count(hits, 1);
+				cache_lru_touch(e);
+				memcpy(dst + i * BLOCK_SIZE, cache.entries[e].data,
+				       BLOCK_SIZE);
+				i++;
+				continue;
+			}
+
+			/* Request the following uncached blocks in one go */
+			while (i + miss < count && (!cache.nblocks ||
+			       cache_lookup(block + i + miss) == NO_ENTRY))
+				miss++;
+
+			cache_count(misses, miss);
+			reqs[nreqs].block = block + i;
+			reqs[nreqs].count = miss;
+			reqs[nreqs].buf = dst + i * BLOCK_SIZE;
+			nreqs++;
+			i += miss;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	/* Uncached blocks are read without the lock, so that other threads can
+	use the cache meanwhile */
+	ret = cache_aio_run(reqs, nreqs);
+	free(reqs);
+	if (ret == -1)
+		return -1;
+
+	/* Keep blocks read on their own, small accesses tend to come back */
+	if (!cache.nblocks)
+		return 0;
+	pthread_mutex_lock(&cache_lock);
+	for (size_t r = 0; r < nruns; r++) {
+		if (runs[r].count == 1 && cache_lookup(runs[r].block) == NO_ENTRY)
+			cache_insert(runs[r].block, runs[r].buf);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+int cache_write_runs(const struct block_aio *runs, size_t nruns)
+{
+	struct block_aio *reqs;
+	size_t nreqs = 0;
+	int ret = 0;
+
+	reqs = calloc(nruns, sizeof(struct block_aio));
+	if (!reqs) {
+		cache_error("cannot allocate %zu requests", nruns);
+		return -1;
+	}
+
+	/*
+	 * Single blocks go to the cache first, so that any block they push out
+	 * reaches the disk before the direct writes below
+	 */
+	pthread_mutex_lock(&cache_lock);
+	for (size_t r = 0; r < nruns; r++) {
+		if (runs[r].count == 1 &&
+		    (cache.nblocks ? cache_write_block(runs[r].block, runs[r].buf) :
+				     block_write(runs[r].block, runs[r].buf)) == -1)
+			ret = -1;
+	}
+
+	/*
+	 * Cached copies of the blocks written through are updated before the
+	 * lock is released: an eviction meanwhile must not write back an older
+	 * copy over them. They stay dirty until the write has succeeded
+	 */
+	for (size_t r = 0; r < nruns; r++) {
+		const uint8_t *src = runs[r].buf;
+
+		if (runs[r].count == 1)
+			continue;
+
+		reqs[nreqs] = runs[r];
+		reqs[nreqs].write = 1;
+		reqs[nreqs].status = -1;
+		nreqs++;
+
+		for (size_t i = 0; i < runs[r].count; i++) {
+			int e = cache.nblocks ?
+				cache_lookup(runs[r].block + i) : NO_ENTRY;
+
+			if (e == NO_ENTRY) {
+				cache_count(misses, 1);
+				continue;
+			}
+
+			cache_count(hits, 1);
+			memcpy(cache.entries[e].data, src + i * BLOCK_SIZE,
+			       BLOCK_SIZE);
+			cache.entries[e].dirty = 1;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	if (cache_aio_run(reqs, nreqs) == -1)
+		ret = -1;
+
+	/*
+	 * Copies of the blocks now on disk are clean, unless another write
+	 * changed them meanwhile. Those of failed writes stay dirty, for the
+	 * next write-back to try again
+	 */
+	pthread_mutex_lock(&cache_lock);
+	for (size_t r = 0; cache.nblocks && r < nreqs; r++) {
+		const uint8_t *src = reqs[r].buf;
+
+		if (reqs[r].status == -1)
+			continue;
+
+		for (size_t i = 0; i < reqs[r].count; i++) {
+			int e = cache_lookup(reqs[r].block + i);
+
+			if (e != NO_ENTRY &&
+			    memcmp(cache.entries[e].data, src + i * BLOCK_SIZE,
+				   BLOCK_SIZE) == 0)
+				cache.entries[e].dirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	free(reqs);
+
+	return ret;
+}
+
+void cache_get_stats(struct cache_stats *stats)
+{
+	/* Plain copy, a counter may lag behind by an in-flight access */
+	*stats = cache.stats;
+}
@@ -0,0 +1,114 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h> /* for size_t definition */
+
+#include "disk.h"
+
+/** Block cache counters */
+struct cache_stats {
+	/* Accesses served from the cache */
+	size_t hits;
+	/* Accesses that had to go to the disk */
+	size_t misses;
+	/* Dirty blocks written back to the disk */
+	size_t writebacks;
+	/* Valid blocks dropped to make room for another block */
+	size_t evictions;
+};
+
+/**
+ * cache_init - Set up the block cache
+ * @nblocks: Number of blocks the cache can hold
+ *
+ * Allocate a write-back cache of @nblocks blocks in front of the currently
+ * open virtual disk. A cache of 0 blocks is valid and simply forwards every
+ * access to block_read() and block_write().
+ *
+ * Once set up, the cache can be used from several threads at once. Runs of
+ * blocks passed to cache_read_runs() and cache_write_runs() go to the disk
+ * outside of its lock.
+ *
+ * Return: -1 if the cache is already set up or cannot be allocated. 0
+ * otherwise.
+ */
+int cache_init(size_t nblocks);
+
+/**
+ * cache_destroy - Tear down the block cache
+ *
+ * Write back every dirty block and release the cache.
+ *
+ * Return: -1 if the cache was not set up or if a dirty block cannot be written
+ * back. 0 otherwise.
+ */
+int cache_destroy(void);
+
+/**
+ * cache_flush - Write back dirty blocks
+ *
+ * Write every dirty block to the virtual disk. Blocks stay in the cache.
+ *
+ * Return: -1 if a dirty block cannot be written back. 0 otherwise.
+ */
+int cache_flush(void);
+
+/**
+ * cache_read - Read a block through the cache
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if the block cannot be read from the disk, or if the block it
+ * replaces cannot be written back. 0 otherwise.
+ */
+int cache_read(size_t block, void *buf);
+
+/**
+ * cache_write - Write a block through the cache
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * The block is only marked dirty, it reaches the disk when it is evicted or
+ * when the cache is flushed.
+ *
+ * Return: -1 if the block it replaces cannot be written back, or if the cache
+ * holds no block and the write to disk fails. 0 otherwise.
+ */
+int cache_write(size_t block, const void *buf);
+
+/**
+ * cache_read_runs - Read runs of consecutive blocks through the cache
+ * @runs: Runs of blocks to read, see &struct block_aio
+ * @nruns: Number of runs in @runs
+ *
+ * Cached blocks are copied from the cache. The uncached blocks of all the runs
+ * are requested from the disk at once with block_aio_submit(), one request per
+ * stretch of consecutive uncached blocks, straight into the runs' buffers.
+ * Only runs of a single block are added to the cache, so that large sequential
+ * reads do not push out frequently used blocks.
+ *
+ * Return: -1 if reading from the disk fails. 0 otherwise.
+ */
+int cache_read_runs(const struct block_aio *runs, size_t nruns);
+
+/**
+ * cache_write_runs - Write runs of consecutive blocks through the cache
+ * @runs: Runs of blocks to write, see &struct block_aio
+ * @nruns: Number of runs in @runs
+ *
+ * Runs of a single block are handled like cache_write(). Longer runs are all
+ * written through to the disk at once with block_aio_submit(), and the copies
+ * of their blocks that are cached are updated. Those copies stay dirty if the
+ * write fails, for a later write-back to try again.
+ *
+ * Return: -1 if writing to the disk fails. 0 otherwise.
+ */
+int cache_write_runs(const struct block_aio *runs, size_t nruns);
+
+/**
+ * cache_get_stats - Get block cache counters
+ * @stats: Structure to be filled with the counters
+ */
+void cache_get_stats(struct cache_stats *stats);
+
+#endif /* _CACHE_H */
@@ -1,84 +1,414 @@
-#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/stat.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
 
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && \
+    !defined(DISK_NO_IO_URING)
+#define HAVE_IO_URING 1
+#endif
+
+#ifdef HAVE_IO_URING
+/*
+ * The parts of the io_uring interface in use, as laid out by the kernel. They
+ * are kept here since <linux/io_uring.h> is not always installed and drags in
+ * a BLOCK_SIZE of its own.
+ */
+
+/* Submission queue entry */
+struct uring_sqe {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t ioprio;
+	int32_t fd;
+	uint64_t off;
+	uint64_t addr;
+	uint32_t len;
+	uint32_t rw_flags;
+	uint64_t user_data;
+	uint64_t pad[3];
+};
+
+/* Completion queue entry */
+struct uring_cqe {
+	uint64_t user_data;
+	int32_t res;
+	uint32_t flags;
+};
+
+/* Offsets of the submission ring fields */
+struct uring_sq_offsets {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t ring_mask;
+	uint32_t ring_entries;
+	uint32_t flags;
+	uint32_t dropped;
+	uint32_t array;
+	uint32_t resv1;
+	uint64_t user_addr;
+};
+
+/* Offsets of the completion ring fields */
+struct uring_cq_offsets {
+	uint32_t head;
+	uint32_t tail;
+	uint32_t ring_mask;
+	uint32_t ring_entries;
+	uint32_t overflow;
+	uint32_t cqes;
+	uint32_t flags;
+	uint32_t resv1;
+	uint64_t user_addr;
+};
+
+/* Filled in by io_uring_setup() */
+struct uring_params {
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+	uint32_t flags;
+	uint32_t sq_thread_cpu;
+	uint32_t sq_thread_idle;
+	uint32_t features;
+	uint32_t wq_fd;
+	uint32_t resv[3];
+	struct uring_sq_offsets sq_off;
+	struct uring_cq_offsets cq_off;
+};
+
+_Static_assert(sizeof(struct uring_sqe) == 64, "io_uring sqe layout");
+_Static_assert(sizeof(struct uring_cqe) == 16, "io_uring cqe layout");
+_Static_assert(sizeof(struct uring_params) == 120, "io_uring params layout");
+
+#define URING_OP_READ 22
+#define URING_OP_WRITE 23
+
+/* Rings share a single mapping */
+#define URING_FEAT_SINGLE_MMAP (1U << 0)
+/* Plain reads and writes are served (Linux 5.6 and later) */
+#define URING_FEAT_RW_CUR_POS (1U << 3)
+
+#define URING_ENTER_GETEVENTS (1U << 0)
+
+/* Mapping offsets of the rings */
+#define URING_OFF_SQ_RING 0ULL
+#define URING_OFF_CQ_RING 0x8000000ULL
+#define URING_OFF_SQES 0x10000000ULL
+#endif
+
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Number of pooled buffer sizes, from 1 to 2^(BUF_POOL_CLASSES-1) blocks */
+#define BUF_POOL_CLASSES 9
+
+/* Number of free buffers kept per size */
+#define BUF_POOL_KEEP 4
+
+/* Free aligned buffers, by size */
+struct buf_pool {
+	pthread_mutex_t lock;
+	void *free[BUF_POOL_CLASSES][BUF_POOL_KEEP];
+	size_t nfree[BUF_POOL_CLASSES];
+};
+
+/* Aligned buffers are used from worker threads too */
+static struct buf_pool buf_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Number of worker threads serving requests when io_uring is unavailable */
+#define AIO_THREADS 4
+
+/* How asynchronous requests are served */
+enum aio_mode {
+	/* Not set up yet */
+	AIO_NONE,
+	/* Completed right away, for mapped disks */
+	AIO_SYNC,
+	/* Handed to the kernel through an io_uring */
+	AIO_URING,
+	/* Handed to a pool of worker threads */
+	AIO_POOL,
+};
+
+#ifdef HAVE_IO_URING
+/* Submission and completion rings shared with the kernel */
+struct aio_uring {
+	int fd;
+	/* Disk's file descriptor */
+	int disk_fd;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+#endif
+
+/* Worker threads and their request queues */
+struct aio_pool {
+	pthread_t threads[AIO_THREADS];
+	size_t nthreads;
+	pthread_mutex_t lock;
+	/* Signaled when a request is queued or the pool stops */
+	pthread_cond_t queued;
+	/* Signaled when a request completes */
+	pthread_cond_t completed;
+	/* Requests waiting for a worker */
+	struct block_aio *pending[BLOCK_AIO_DEPTH];
+	size_t pending_head;
+	size_t pending_count;
+	/* Requests waiting to be reaped */
+	struct block_aio *done[BLOCK_AIO_DEPTH];
+	size_t done_head;
+	size_t done_count;
+	int stop;
+};
+
+/* Asynchronous I/O state of a disk */
+struct aio {
+	enum aio_mode mode;
+	/* Requests submitted but not reaped yet */
+	size_t inflight;
+#ifdef HAVE_IO_URING
+	struct aio_uring ring;
+#endif
+	struct aio_pool pool;
+};
+
 /* Disk instance description */
 struct disk {
-	/* File descriptor */
-	int fd;
+	/* Backend serving the blocks, NULL if no disk is open */
+	const struct block_backend *backend;
 	/* Block count */
 	size_t bcount;
+	/* Flags the disk was opened with */
+	int flags;
+	/* Block following the last one accessed */
+	size_t next_block;
+	/* Counters, updated atomically since worker threads do I/O too */
+	struct block_stats stats;
+	/* Asynchronous requests */
+	struct aio aio;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Currently open virtual disk (none by default) */
+static struct disk disk;
 
-int block_disk_open(const char *diskname)
+/* Returns the size class of a buffer of count blocks */
+static size_t buf_pool_class(size_t count)
 {
-	int fd;
-	struct stat st;
+	size_t c = 0;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
-		return -1;
+	while (((size_t)1 << c) < count)
+		c++;
+
+	return c;
+}
+
+void *block_buf_alloc(size_t count)
+{
+	size_t c = buf_pool_class(count);
+	void *buf = NULL;
+
+	if (count == 0)
+		return NULL;
+
+	if (c < BUF_POOL_CLASSES) {
+		pthread_mutex_lock(&buf_pool.lock);
+		if (buf_pool.nfree[c] > 0)
+			buf = buf_pool.free[c][--buf_pool.nfree[c]];
+		pthread_mutex_unlock(&buf_pool.lock);
+		if (buf)
+			return buf;
+
+		/* Round up so that the buffer can be pooled afterwards */
+		count = (size_t)1 << c;
 	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
-		return -1;
+	if (posix_memalign(&buf, BLOCK_SIZE, count * BLOCK_SIZE)) {
+		block_error("cannot allocate %zu blocks", count);
+		return NULL;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
-		perror("open");
-		return -1;
+	return buf;
+}
+
+void block_buf_free(void *buf, size_t count)
+{
+	size_t c = buf_pool_class(count);
+
+	if (!buf)
+		return;
+
+	if (c < BUF_POOL_CLASSES) {
+		pthread_mutex_lock(&buf_pool.lock);
+		if (buf_pool.nfree[c] < BUF_POOL_KEEP) {
+			buf_pool.free[c][buf_pool.nfree[c]++] = buf;
+			buf = NULL;
+		}
+		pthread_mutex_unlock(&buf_pool.lock);
+	}
+
+	free(buf);
+}
+
+/* Release every pooled buffer */
+static void buf_pool_trim(void)
+{
+	pthread_mutex_lock(&buf_pool.lock);
+	for (size_t c = 0; c < BUF_POOL_CLASSES; c++) {
+		while (buf_pool.nfree[c] > 0)
+			free(buf_pool.free[c][--buf_pool.nfree[c]]);
+	}
+	pthread_mutex_unlock(&buf_pool.lock);
+}
+
+/* O_DIRECT transfers need buffers aligned on a block */
+static int block_aligned(const void *buf)
+{
+	return ((uintptr_t)buf % BLOCK_SIZE) == 0;
+}
+
+static void aio_teardown(void);
+
+/* Monotonic time in nanoseconds */
+static uint64_t block_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Returns the latency histogram bucket of an operation that took ns */
+static size_t block_lat_bucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	size_t b = 0;
+
+	while (us >= 2 && b < BLOCK_LAT_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+
+	return b;
+}
+
+/* Account an operation on count blocks from block, started at start_ns */
+static void block_account(int write, size_t block, size_t count,
+			  uint64_t start_ns, int ret)
+{
+	struct block_stats *stats = &disk.stats;
+	size_t b = block_lat_bucket(block_now() - start_ns);
+
+	if (__atomic_exchange_n(&disk.next_block, block + count,
+				__ATOMIC_RELAXED) != block)
+		__atomic_fetch_add(&stats->seeks, 1, __ATOMIC_RELAXED);
+
+	if (ret == -1)
+		__atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+
+	if (write) {
+		__atomic_fetch_add(&stats->writes, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats->bytes_written, count * BLOCK_SIZE,
+				   __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats->write_latency[b], 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&stats->reads, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats->bytes_read, count * BLOCK_SIZE,
+				   __ATOMIC_RELAXED);
+		__atomic_fetch_add(&stats->read_latency[b], 1, __ATOMIC_RELAXED);
 	}
+}
+
+int block_disk_open(const char *diskname)
+{
+	return block_disk_open_ext(diskname, 0);
+}
+
+int block_disk_open_ext(const char *diskname, int flags)
+{
+	return block_disk_open_backend(&block_file_backend, diskname, flags, 0);
+}
 
-	if (fstat(fd, &st)) {
-		perror("fstat");
+int block_disk_open_backend(const struct block_backend *backend,
+			    const char *diskname, int flags, size_t bcount)
+{
+	if (!backend) {
+		block_error("invalid backend");
 		return -1;
 	}
 
-	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	if (disk.backend) {
+		block_error("disk already open");
 		return -1;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	if (backend->open(diskname, flags, bcount) == -1)
+		return -1;
+
+	disk.backend = backend;
+	disk.bcount = backend->count();
+	disk.flags = flags;
+	disk.next_block = 0;
+	memset(&disk.stats, 0, sizeof(struct block_stats));
 
 	return 0;
 }
 
 int block_disk_close(void)
 {
-	if (disk.fd == INVALID_FD) {
+	int ret;
+
+	if (!disk.backend) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	close(disk.fd);
+	aio_teardown();
+	ret = disk.backend->close();
+	buf_pool_trim();
 
-	disk.fd = INVALID_FD;
+	disk.backend = NULL;
+	disk.bcount = 0;
+	disk.flags = 0;
 
-	return 0;
+	return ret;
+}
+
+int block_disk_flush(void)
+{
+	if (!disk.backend) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	return disk.backend->flush();
 }
 
 int block_disk_count(void)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!disk.backend) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -88,7 +418,10 @@ int block_disk_count(void)
 
 int block_write(size_t block, const void *buf)
 {
-	if (disk.fd == INVALID_FD) {
+	uint64_t start_ns;
+	int ret;
+
+	if (!disk.backend) {
 		block_error("no disk currently open");
 		return -1;
 	}
@@ -99,46 +432,567 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	start_ns = block_now();
+	ret = disk.backend->write(block, buf);
+	block_account(1, block, 1, start_ns, ret);
+
+	return ret;
+}
+
+int block_read(size_t block, void *buf)
+{
+	uint64_t start_ns;
+	int ret;
+
+	if (!disk.backend) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	if (block >= disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk.bcount);
 		return -1;
 	}
 
-	return 0;
+	start_ns = block_now();
+	ret = disk.backend->read(block, buf);
+	block_account(0, block, 1, start_ns, ret);
+
+	return ret;
 }
 
-int block_read(size_t block, void *buf)
+/* Returns the number of blocks covered by iov, or -1 if the range is invalid */
+static ssize_t block_iov_count(size_t block, const struct iovec *iov, int iovcnt)
 {
-	if (disk.fd == INVALID_FD) {
+	size_t len = 0;
+
+	if (!disk.backend) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (iovcnt <= 0) {
+		block_error("invalid buffer count (%d)", iovcnt);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len == 0 || len % BLOCK_SIZE != 0) {
+		block_error("length '%zu' is not multiple of '%d'", len, BLOCK_SIZE);
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	if (block >= disk.bcount || len / BLOCK_SIZE > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, len / BLOCK_SIZE, disk.bcount);
 		return -1;
 	}
 
+	return len / BLOCK_SIZE;
+}
+
+int block_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	ssize_t count = block_iov_count(block, iov, iovcnt);
+	uint64_t start_ns;
+	int ret;
+
+	if (count == -1)
+		return -1;
+
+	start_ns = block_now();
+	ret = disk.backend->writev(block, iov, iovcnt);
+	block_account(1, block, count, start_ns, ret);
+
+	return ret;
+}
+
+int block_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	ssize_t count = block_iov_count(block, iov, iovcnt);
+	uint64_t start_ns;
+	int ret;
+
+	if (count == -1)
+		return -1;
+
+	start_ns = block_now();
+	ret = disk.backend->readv(block, iov, iovcnt);
+	block_account(0, block, count, start_ns, ret);
+
+	return ret;
+}
+
+void block_get_stats(struct block_stats *stats)
+{
+	/* Plain copy, a counter may lag behind by an in-flight operation */
+	*stats = disk.stats;
+}
+
+const void *block_map(size_t block)
+{
+	if (!disk.backend || !disk.backend->map || block >= disk.bcount)
+		return NULL;
+
+	return disk.backend->map(block);
+}
+
+/* Perform a request synchronously */
+static int aio_execute(struct block_aio *req)
+{
+	struct iovec iov = {
+		.iov_base = req->buf,
+		.iov_len = req->count * BLOCK_SIZE,
+	};
+
+	if (req->write)
+		return block_writev(req->block, &iov, 1);
+	return block_readv(req->block, &iov, 1);
+}
+
+/* Add a completed request to the pool's done queue, lock held */
+static void aio_pool_complete(struct block_aio *req)
+{
+	struct aio_pool *pool = &disk.aio.pool;
+
+	pool->done[(pool->done_head + pool->done_count) % BLOCK_AIO_DEPTH] = req;
+	pool->done_count++;
+	pthread_cond_signal(&pool->completed);
+}
+
+static void *aio_pool_worker(void *arg)
+{
+	struct aio_pool *pool = arg;
+	struct block_aio *req;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->stop && pool->pending_count == 0)
+			pthread_cond_wait(&pool->queued, &pool->lock);
+		if (pool->pending_count == 0)
+			break;
+
+		req = pool->pending[pool->pending_head];
+		pool->pending_head = (pool->pending_head + 1) % BLOCK_AIO_DEPTH;
+		pool->pending_count--;
+
+		pthread_mutex_unlock(&pool->lock);
+		req->status = aio_execute(req);
+		pthread_mutex_lock(&pool->lock);
+
+		aio_pool_complete(req);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+#ifdef HAVE_IO_URING
+static int aio_uring_enter(unsigned to_submit, unsigned min_complete,
+			   unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, disk.aio.ring.fd, to_submit,
+		       min_complete, flags, NULL, 0);
+}
+
+static int aio_uring_setup(int disk_fd)
+{
+	struct aio_uring *ring = &disk.aio.ring;
+	struct uring_params p;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, BLOCK_AIO_DEPTH, &p);
+	if (fd < 0)
+		return -1;
+
+	/* Plain reads and writes are needed */
+	if (!(p.features & URING_FEAT_RW_CUR_POS)) {
+		close(fd);
+		return -1;
+	}
+
+	ring->fd = fd;
+	ring->disk_fd = disk_fd;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct uring_cqe);
+	if (p.features & URING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, fd, URING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	if (p.features & URING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, fd,
+				     URING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			close(fd);
+			return -1;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, fd, URING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != ring->sq_ring)
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(fd);
+		return -1;
+	}
+
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct uring_cqe *)
+		((char *)ring->cq_ring + p.cq_off.cqes);
+
 	return 0;
 }
 
+static void aio_uring_teardown(void)
+{
+	struct aio_uring *ring = &disk.aio.ring;
+
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+/*
+ * Hand the @queued entries written from @tail on to the kernel, and return how
+ * many it took. Entries it did not take are dropped from the ring again so
+ * that a later submission does not pick them up.
+ */
+static size_t aio_uring_flush(unsigned tail, size_t queued)
+{
+	struct aio_uring *ring = &disk.aio.ring;
+	size_t submitted = 0;
+
+	/* Publish the entries before telling the kernel about them */
+	__atomic_store_n(ring->sq_tail, tail + queued, __ATOMIC_RELEASE);
+
+	while (submitted < queued) {
+		int ret = aio_uring_enter(queued - submitted, 0, 0);
+
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			perror("io_uring_enter");
+			__atomic_store_n(ring->sq_tail, tail + submitted,
+					 __ATOMIC_RELEASE);
+			break;
+		}
+		submitted += ret;
+	}
+
+	return submitted;
+}
+
+/* Return the number of leading requests of @reqs accepted */
+static size_t aio_uring_submit(struct block_aio *reqs, size_t nreqs)
+{
+	struct aio_pool *pool = &disk.aio.pool;
+	struct aio_uring *ring = &disk.aio.ring;
+	unsigned tail = *ring->sq_tail;
+	size_t queued = 0;
+	size_t accepted = 0;
+
+	for (size_t i = 0; i < nreqs; i++) {
+		unsigned idx = (tail + queued) & *ring->sq_mask;
+		struct uring_sqe *sqe = &ring->sqes[idx];
+
+		/* The kernel would reject it, bounce it synchronously */
+		if ((disk.flags & BLOCK_DISK_DIRECT) &&
+		    !block_aligned(reqs[i].buf)) {
+			/* Requests before it must be accepted first */
+			if (queued > 0) {
+				size_t submitted = aio_uring_flush(tail, queued);
+
+				accepted += submitted;
+				if (submitted < queued)
+					return accepted;
+				tail += queued;
+				queued = 0;
+			}
+
+			reqs[i].status = aio_execute(&reqs[i]);
+			pthread_mutex_lock(&pool->lock);
+			aio_pool_complete(&reqs[i]);
+			pthread_mutex_unlock(&pool->lock);
+			accepted++;
+			continue;
+		}
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = reqs[i].write ? URING_OP_WRITE : URING_OP_READ;
+		sqe->fd = ring->disk_fd;
+		sqe->addr = (uintptr_t)reqs[i].buf;
+		sqe->len = reqs[i].count * BLOCK_SIZE;
+		sqe->off = reqs[i].block * BLOCK_SIZE;
+		sqe->user_data = (uintptr_t)&reqs[i];
+		ring->sq_array[idx] = idx;
+		queued++;
+	}
+
+	if (queued > 0)
+		accepted += aio_uring_flush(tail, queued);
+
+	return accepted;
+}
+
+static size_t aio_uring_reap(struct block_aio **done, size_t max, size_t min)
+{
+	struct aio_uring *ring = &disk.aio.ring;
+	size_t count = 0;
+
+	while (count < max) {
+		unsigned head = *ring->cq_head;
+		struct uring_cqe *cqe;
+		struct block_aio *req;
+
+		if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			if (count >= min)
+				break;
+			if (aio_uring_enter(0, min - count,
+					    URING_ENTER_GETEVENTS) < 0 &&
+			    errno != EINTR) {
+				perror("io_uring_enter");
+				break;
+			}
+			continue;
+		}
+
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		req = (struct block_aio *)(uintptr_t)cqe->user_data;
+		req->status = 0;
+		if (cqe->res != (int)(req->count * BLOCK_SIZE)) {
+			block_error("%s of blocks %zu+%zu failed (%d)",
+				    req->write ? "write" : "read",
+				    req->block, req->count, cqe->res);
+			req->status = -1;
+		}
+		__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+		block_account(req->write, req->block, req->count,
+			      req->submit_ns, req->status);
+
+		done[count++] = req;
+	}
+
+	return count;
+}
+#endif
+
+/* Pick and set up the way requests are served */
+static int aio_setup(void)
+{
+	struct aio_pool *pool = &disk.aio.pool;
+
+	memset(pool, 0, sizeof(struct aio_pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->queued, NULL);
+	pthread_cond_init(&pool->completed, NULL);
+
+	/* Memory copies gain nothing from being deferred */
+	if (block_map(0)) {
+		disk.aio.mode = AIO_SYNC;
+		return 0;
+	}
+
+#ifdef HAVE_IO_URING
+	/* The kernel can only serve disks backed by a host file */
+	if (disk.backend->fd && disk.backend->fd() != INVALID_FD &&
+	    aio_uring_setup(disk.backend->fd()) == 0) {
+		disk.aio.mode = AIO_URING;
+		return 0;
+	}
+#endif
+
+	for (pool->nthreads = 0; pool->nthreads < AIO_THREADS; pool->nthreads++) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+				   aio_pool_worker, pool))
+			break;
+	}
+	if (pool->nthreads == 0) {
+		block_error("cannot start worker threads");
+		return -1;
+	}
+
+	disk.aio.mode = AIO_POOL;
+
+	return 0;
+}
+
+/* Wait for requests still in flight and release the asynchronous I/O state */
+static void aio_teardown(void)
+{
+	struct aio_pool *pool = &disk.aio.pool;
+	struct block_aio *done[BLOCK_AIO_DEPTH];
+
+	if (disk.aio.mode == AIO_NONE)
+		return;
+
+	while (disk.aio.inflight)
+		block_aio_reap(done, BLOCK_AIO_DEPTH, disk.aio.inflight);
+
+#ifdef HAVE_IO_URING
+	if (disk.aio.mode == AIO_URING)
+		aio_uring_teardown();
+#endif
+
+	if (disk.aio.mode == AIO_POOL) {
+		pthread_mutex_lock(&pool->lock);
+		pool->stop = 1;
+		pthread_cond_broadcast(&pool->queued);
+		pthread_mutex_unlock(&pool->lock);
+		for (size_t i = 0; i < pool->nthreads; i++)
+			pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->queued);
+	pthread_cond_destroy(&pool->completed);
+
+	disk.aio.mode = AIO_NONE;
+}
+
+int block_aio_submit(struct block_aio *reqs, size_t nreqs)
+{
+	struct aio_pool *pool = &disk.aio.pool;
+	size_t n;
+
+	if (!disk.backend) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	for (size_t i = 0; i < nreqs; i++) {
+		if (reqs[i].count == 0 || reqs[i].block >= disk.bcount ||
+		    reqs[i].count > disk.bcount - reqs[i].block) {
+			block_error("block range out of bounds (%zu+%zu/%zu)",
+				    reqs[i].block, reqs[i].count, disk.bcount);
+			return -1;
+		}
+	}
+
+	if (disk.aio.mode == AIO_NONE && aio_setup() == -1)
+		return -1;
+
+	n = BLOCK_AIO_DEPTH - disk.aio.inflight;
+	if (n > nreqs)
+		n = nreqs;
+	if (n == 0)
+		return 0;
+
+	for (size_t i = 0; i < n; i++)
+		reqs[i].submit_ns = block_now();
+
+	switch (disk.aio.mode) {
+#ifdef HAVE_IO_URING
+	case AIO_URING:
+		/* Some requests may have been taken before a failure */
+		n = aio_uring_submit(reqs, n);
+		if (n == 0)
+			return -1;
+		break;
+#endif
+	case AIO_POOL:
+		pthread_mutex_lock(&pool->lock);
+		for (size_t i = 0; i < n; i++) {
+			size_t slot = (pool->pending_head + pool->pending_count) %
+				BLOCK_AIO_DEPTH;
+
+			pool->pending[slot] = &reqs[i];
+			pool->pending_count++;
+		}
+		pthread_cond_broadcast(&pool->queued);
+		pthread_mutex_unlock(&pool->lock);
+		break;
+	default:
+		pthread_mutex_lock(&pool->lock);
+		for (size_t i = 0; i < n; i++) {
+			reqs[i].status = aio_execute(&reqs[i]);
+			aio_pool_complete(&reqs[i]);
+		}
+		pthread_mutex_unlock(&pool->lock);
+		break;
+	}
+
+	disk.aio.inflight += n;
+
+	return n;
+}
+
+int block_aio_reap(struct block_aio **done, size_t max, size_t min)
+{
+	struct aio_pool *pool = &disk.aio.pool;
+	size_t count = 0;
+
+	if (!disk.backend) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (min > disk.aio.inflight || min > max) {
+		block_error("cannot wait for %zu requests (%zu in flight)",
+			    min, disk.aio.inflight);
+		return -1;
+	}
+
+	if (disk.aio.inflight == 0)
+		return 0;
+
+#ifdef HAVE_IO_URING
+	if (disk.aio.mode == AIO_URING) {
+		/* Requests bounced at submission time come first */
+		pthread_mutex_lock(&pool->lock);
+		while (count < max && pool->done_count > 0) {
+			done[count++] = pool->done[pool->done_head];
+			pool->done_head = (pool->done_head + 1) % BLOCK_AIO_DEPTH;
+			pool->done_count--;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		count += aio_uring_reap(done + count, max - count,
+					(min > count) ? min - count : 0);
+		disk.aio.inflight -= count;
+		return count;
+	}
+#endif
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->done_count < min)
+		pthread_cond_wait(&pool->completed, &pool->lock);
+	while (count < max && pool->done_count > 0) {
+		done[count++] = pool->done[pool->done_head];
+		pool->done_head = (pool->done_head + 1) % BLOCK_AIO_DEPTH;
+		pool->done_count--;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	disk.aio.inflight -= count;
+
+	return count;
+}
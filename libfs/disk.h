@@ -2,10 +2,100 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint64_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Open flag: map the whole virtual disk file in memory */
+#define BLOCK_DISK_MMAP 0x1
+
+/** Open flag: bypass the host's page cache (O_DIRECT) */
+#define BLOCK_DISK_DIRECT 0x2
+
+/**
+ * Block device backend, see block_disk_open_backend()
+ *
+ * Only one disk is open at a time, so a backend keeps the state of its open
+ * device to itself. Block indexes and buffer lengths are checked against the
+ * device's block count before any operation is called.
+ */
+struct block_backend {
+	/* Name, for messages */
+	const char *name;
+	/* Open the device; @bcount is the size of devices without one of their
+	 * own, in blocks */
+	int (*open)(const char *diskname, int flags, size_t bcount);
+	/* Write back and close the device */
+	int (*close)(void);
+	/* Number of blocks */
+	size_t (*count)(void);
+	/* Transfer one block */
+	int (*read)(size_t block, void *buf);
+	int (*write)(size_t block, const void *buf);
+	/* Transfer consecutive blocks from/to several buffers */
+	int (*readv)(size_t block, const struct iovec *iov, int iovcnt);
+	int (*writev)(size_t block, const struct iovec *iov, int iovcnt);
+	/* Make every write durable */
+	int (*flush)(void);
+	/* Optional: address of a block if the device lives in memory, or NULL */
+	void *(*map)(size_t block);
+	/* Optional: host file descriptor giving access to the blocks, or -1 */
+	int (*fd)(void);
+};
+
+/** Backend for virtual disk files, see block_disk_open_ext() */
+extern const struct block_backend block_file_backend;
+
+/** Backend for disks kept in memory only, lost once closed */
+extern const struct block_backend block_ram_backend;
+
+/** Maximum number of asynchronous requests in flight */
+#define BLOCK_AIO_DEPTH 64
+
+/** Asynchronous block request, see block_aio_submit() */
+struct block_aio {
+	/* Index of the first block */
+	size_t block;
+	/* Number of consecutive blocks */
+	size_t count;
+	/* Data buffer of @count * %BLOCK_SIZE bytes */
+	void *buf;
+	/* Write @buf to the blocks instead of reading them into @buf */
+	int write;
+	/* Set on completion: -1 if the operation failed, 0 otherwise */
+	int status;
+	/* Set by block_aio_submit(), for latency accounting */
+	uint64_t submit_ns;
+};
+
+/** Number of buckets in latency histograms */
+#define BLOCK_LAT_BUCKETS 24
+
+/**
+ * Disk access counters, see block_get_stats()
+ *
+ * Latency histograms are log2-bucketed in microseconds: bucket 0 counts
+ * operations that took less than 2us, bucket i those that took from 2^i to
+ * 2^(i+1) us, and the last bucket everything slower.
+ */
+struct block_stats {
+	/* Read and write operations, vectored and asynchronous ones included */
+	size_t reads;
+	size_t writes;
+	/* Bytes transferred */
+	size_t bytes_read;
+	size_t bytes_written;
+	/* Operations not starting where the previous one ended */
+	size_t seeks;
+	/* Failed operations */
+	size_t errors;
+	/* Latency histograms */
+	size_t read_latency[BLOCK_LAT_BUCKETS];
+	size_t write_latency[BLOCK_LAT_BUCKETS];
+};
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -19,6 +109,45 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_ext - Open virtual disk file with flags
+ * @diskname: Name of the virtual disk file
+ * @flags: Bitwise OR of open flags
+ *
+ * Same as block_disk_open(), with the behavior selected by @flags.
+ *
+ * With %BLOCK_DISK_MMAP, the whole virtual disk file is mapped in memory and
+ * blocks are read and written with memcpy() instead of system calls. The
+ * mapping is synchronized back to the file by block_disk_close().
+ *
+ * With %BLOCK_DISK_DIRECT, the virtual disk file is opened with O_DIRECT so
+ * that its blocks are not kept in the host's page cache. Transfers are fastest
+ * with buffers from block_buf_alloc(); other buffers are copied through an
+ * aligned one.
+ *
+ * Return: -1 if @diskname is invalid, if both %BLOCK_DISK_MMAP and
+ * %BLOCK_DISK_DIRECT are given, if the virtual disk file cannot be opened or
+ * mapped, or if a disk is already open. 0 otherwise.
+ */
+int block_disk_open_ext(const char *diskname, int flags);
+
+/**
+ * block_disk_open_backend - Open a disk served by a backend
+ * @backend: Backend serving the disk's blocks
+ * @diskname: Name of the disk, as understood by @backend
+ * @flags: Bitwise OR of open flags, as understood by @backend
+ * @bcount: Number of blocks, for backends that create their disk (such as
+ * %block_ram_backend)
+ *
+ * Open a disk through @backend. Every other function of this interface then
+ * works on that disk, until block_disk_close() is called.
+ *
+ * Return: -1 if @backend is NULL, if a disk is already open, or if @backend
+ * cannot open the disk. 0 otherwise.
+ */
+int block_disk_open_backend(const struct block_backend *backend,
+			    const char *diskname, int flags, size_t bcount);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +155,17 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_flush - Make writes durable
+ *
+ * Make sure every block written so far is stored by the disk's backend (for
+ * instance with fsync() or msync() for virtual disk files).
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the backend fails
+ * to flush. 0 otherwise.
+ */
+int block_disk_flush(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -60,5 +200,117 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_writev - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @iov: Data buffers to write in the blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Write the content of the @iovcnt buffers described by @iov, one after the
+ * other, in the virtual disk's blocks starting at block @block. The total
+ * length of the buffers must be a multiple of %BLOCK_SIZE; it gives the number
+ * of blocks written. The whole range is written with a single system call.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if the
+ * range of blocks is out of bounds or inaccessible, or if the writing operation
+ * fails. 0 otherwise.
+ */
+int block_writev(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_readv - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @iov: Data buffers to be filled with content of the blocks
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Read the virtual disk's blocks starting at block @block into the @iovcnt
+ * buffers described by @iov, filling one buffer after the other. The total
+ * length of the buffers must be a multiple of %BLOCK_SIZE; it gives the number
+ * of blocks read. The whole range is read with a single system call.
+ *
+ * Return: -1 if the total length is not a multiple of %BLOCK_SIZE, if the
+ * range of blocks is out of bounds or inaccessible, or if the reading operation
+ * fails. 0 otherwise.
+ */
+int block_readv(size_t block, const struct iovec *iov, int iovcnt);
+
+/**
+ * block_aio_submit - Queue asynchronous block requests
+ * @reqs: Array of requests
+ * @nreqs: Number of requests in @reqs
+ *
+ * Start the requests of @reqs, in order, without waiting for them to complete.
+ * At most %BLOCK_AIO_DEPTH requests can be in flight at once, so only part of
+ * @reqs may be queued; the remaining requests can be submitted again once
+ * completions were reaped with block_aio_reap(). The requests and their
+ * buffers must stay valid until they are reaped.
+ *
+ * Requests are served with io_uring when the kernel supports it, and by a pool
+ * of worker threads otherwise.
+ *
+ * Return: -1 if no virtual disk file is opened, if a request is empty or out
+ * of bounds, or if the kernel refuses the first request (nothing is queued
+ * then). Otherwise the number of leading requests of @reqs queued, which is
+ * smaller than expected if the kernel refuses the following ones.
+ */
+int block_aio_submit(struct block_aio *reqs, size_t nreqs);
+
+/**
+ * block_aio_reap - Collect completed asynchronous block requests
+ * @done: Array to be filled with the completed requests
+ * @max: Maximum number of requests to collect
+ * @min: Number of requests to wait for
+ *
+ * Wait until at least @min submitted requests have completed, then collect up
+ * to @max completed requests in @done. The status of each collected request is
+ * set.
+ *
+ * Return: -1 if no virtual disk file is opened, or if @min exceeds the number
+ * of requests in flight. Otherwise the number of requests collected.
+ */
+int block_aio_reap(struct block_aio **done, size_t max, size_t min);
+
+/**
+ * block_buf_alloc - Get an aligned block buffer
+ * @count: Number of blocks the buffer must hold
+ *
+ * Get a buffer of at least @count blocks, aligned on %BLOCK_SIZE as required by
+ * %BLOCK_DISK_DIRECT transfers. Buffers are recycled through a small pool, so
+ * getting one is usually free.
+ *
+ * Return: NULL if @count is 0 or if no memory is available. Otherwise the
+ * buffer.
+ */
+void *block_buf_alloc(size_t count);
+
+/**
+ * block_buf_free - Give back an aligned block buffer
+ * @buf: Buffer returned by block_buf_alloc()
+ * @count: Number of blocks @buf was requested for
+ */
+void block_buf_free(void *buf, size_t count);
+
+/**
+ * block_get_stats - Get disk access counters
+ * @stats: Structure to be filled with the counters
+ *
+ * Fill @stats with the counters accumulated since the current disk was opened.
+ */
+void block_get_stats(struct block_stats *stats);
+
+/**
+ * block_map - Get a block's address in memory
+ * @block: Index of the block
+ *
+ * Give direct access to block @block when the virtual disk was opened with
+ * %BLOCK_DISK_MMAP. The block's %BLOCK_SIZE bytes can be read and written
+ * through the returned pointer until block_disk_close() is called. Blocks
+ * are contiguous in memory, so the pointer also covers the following blocks.
+ *
+ * Return: NULL if no virtual disk file is opened, if it is not mapped, or if
+ * @block is out of bounds. Otherwise the address of the block.
+ */
+const void *block_map(size_t block);
+
 #endif /* _DISK_H */
 
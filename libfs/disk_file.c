@@ -0,0 +1,299 @@
+/* For O_DIRECT */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "disk.h"
+
+#define block_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Invalid file descriptor */
+#define INVALID_FD -1
+
+/* Virtual disk file description */
+struct file_disk {
+	/* File descriptor */
+	int fd;
+	/* Block count */
+	size_t bcount;
+	/* Mapping of the whole disk image, if opened with BLOCK_DISK_MMAP */
+	uint8_t *map;
+	/* Image opened with O_DIRECT, if opened with BLOCK_DISK_DIRECT */
+	int direct;
+};
+
+/* Currently open virtual disk file (invalid by default) */
+static struct file_disk file = { .fd = INVALID_FD };
+
+/* O_DIRECT transfers need buffers aligned on a block */
+static int file_aligned(const void *buf)
+{
+	return ((uintptr_t)buf % BLOCK_SIZE) == 0;
+}
+
+static int file_open(const char *diskname, int flags, size_t bcount)
+{
+	int fd;
+	struct stat st;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if ((flags & BLOCK_DISK_MMAP) && (flags & BLOCK_DISK_DIRECT)) {
+		block_error("cannot both map and bypass the page cache");
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_RDWR |
+		       ((flags & BLOCK_DISK_DIRECT) ? O_DIRECT : 0), 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		close(fd);
+		return -1;
+	}
+
+	/* The disk image's size should be a multiple of the block size */
+	if (st.st_size % BLOCK_SIZE != 0) {
+		block_error("size '%zu' is not multiple of '%d'",
+			    st.st_size, BLOCK_SIZE);
+		close(fd);
+		return -1;
+	}
+
+	/* Serve blocks straight from memory */
+	file.map = NULL;
+	if (flags & BLOCK_DISK_MMAP) {
+		void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap");
+			close(fd);
+			return -1;
+		}
+		file.map = map;
+	}
+
+	file.fd = fd;
+	file.bcount = st.st_size / BLOCK_SIZE;
+	file.direct = (flags & BLOCK_DISK_DIRECT) != 0;
+
+	return 0;
+}
+
+static int file_flush(void)
+{
+	if (file.map) {
+		/* Make sure the image holds everything written in memory */
+		if (msync(file.map, file.bcount * BLOCK_SIZE, MS_SYNC)) {
+			perror("msync");
+			return -1;
+		}
+		return 0;
+	}
+
+	if (fsync(file.fd)) {
+		perror("fsync");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_close(void)
+{
+	if (file.map) {
+		file_flush();
+		munmap(file.map, file.bcount * BLOCK_SIZE);
+		file.map = NULL;
+	}
+
+	close(file.fd);
+
+	file.fd = INVALID_FD;
+	file.direct = 0;
+
+	return 0;
+}
+
+static size_t file_count(void)
+{
+	return file.bcount;
+}
+
+/* Transfer iov through an aligned buffer */
+static int file_bounce(size_t block, const struct iovec *iov, int iovcnt,
+		       int write)
+{
+	size_t len = 0;
+	uint8_t *bounce;
+	uint8_t *p;
+	ssize_t ret;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	bounce = block_buf_alloc(len / BLOCK_SIZE);
+	if (!bounce)
+		return -1;
+	p = bounce;
+
+	if (write) {
+		for (int i = 0; i < iovcnt; i++) {
+			memcpy(p, iov[i].iov_base, iov[i].iov_len);
+			p += iov[i].iov_len;
+		}
+		ret = pwrite(file.fd, bounce, len, block * BLOCK_SIZE);
+		if (ret < 0)
+			perror("pwrite");
+	} else {
+		ret = pread(file.fd, bounce, len, block * BLOCK_SIZE);
+		if (ret < 0)
+			perror("pread");
+		for (int i = 0; ret >= 0 && i < iovcnt; i++) {
+			memcpy(iov[i].iov_base, p, iov[i].iov_len);
+			p += iov[i].iov_len;
+		}
+	}
+
+	block_buf_free(bounce, len / BLOCK_SIZE);
+
+	return (ret < 0) ? -1 : 0;
+}
+
+/* Returns 1 if iov cannot be handed as is to an O_DIRECT transfer */
+static int file_needs_bounce(const struct iovec *iov, int iovcnt)
+{
+	if (!file.direct)
+		return 0;
+
+	for (int i = 0; i < iovcnt; i++) {
+		if (!file_aligned(iov[i].iov_base) ||
+		    iov[i].iov_len % BLOCK_SIZE != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int file_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	if (file.map) {
+		uint8_t *dst = file.map + block * BLOCK_SIZE;
+
+		for (int i = 0; i < iovcnt; i++) {
+			memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+			dst += iov[i].iov_len;
+		}
+		return 0;
+	}
+
+	if (file_needs_bounce(iov, iovcnt))
+		return file_bounce(block, iov, iovcnt, 1);
+
+	/* Perform the actual write into the disk image, in one call */
+	if (pwritev(file.fd, iov, iovcnt, block * BLOCK_SIZE) < 0) {
+		perror("pwritev");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	if (file.map) {
+		const uint8_t *src = file.map + block * BLOCK_SIZE;
+
+		for (int i = 0; i < iovcnt; i++) {
+			memcpy(iov[i].iov_base, src, iov[i].iov_len);
+			src += iov[i].iov_len;
+		}
+		return 0;
+	}
+
+	if (file_needs_bounce(iov, iovcnt))
+		return file_bounce(block, iov, iovcnt, 0);
+
+	/* Perform the actual read from the disk image, in one call */
+	if (preadv(file.fd, iov, iovcnt, block * BLOCK_SIZE) < 0) {
+		perror("preadv");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_write(size_t block, const void *buf)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = BLOCK_SIZE };
+
+	if (file.map || (file.direct && !file_aligned(buf)))
+		return file_writev(block, &iov, 1);
+
+	/* Perform the actual write into the disk image at the block's offset */
+	if (pwrite(file.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int file_read(size_t block, void *buf)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = BLOCK_SIZE };
+
+	if (file.map || (file.direct && !file_aligned(buf)))
+		return file_readv(block, &iov, 1);
+
+	/* Perform the actual read from the disk image at the block's offset */
+	if (pread(file.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pread");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void *file_map(size_t block)
+{
+	if (!file.map)
+		return NULL;
+
+	return file.map + block * BLOCK_SIZE;
+}
+
+static int file_fd(void)
+{
+	/* Mapped images are accessed through memory only */
+	return file.map ? INVALID_FD : file.fd;
+}
+
+const struct block_backend block_file_backend = {
+	.name = "file",
+	.open = file_open,
+	.close = file_close,
+	.count = file_count,
+	.read = file_read,
+	.write = file_write,
+	.readv = file_readv,
+	.writev = file_writev,
+	.flush = file_flush,
+	.map = file_map,
+	.fd = file_fd,
+};
@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+
+#define block_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* RAM disk description */
+struct ram_disk {
+	/* Block contents */
+	uint8_t *mem;
+	/* Block count */
+	size_t bcount;
+};
+
+/* Currently open RAM disk */
+static struct ram_disk ram;
+
+static int ram_open(const char *diskname, int flags, size_t bcount)
+{
+	void *mem;
+
+	if (bcount == 0) {
+		block_error("invalid block count");
+		return -1;
+	}
+
+	/* Aligned like any other block buffer */
+	if (posix_memalign(&mem, BLOCK_SIZE, bcount * BLOCK_SIZE)) {
+		block_error("cannot allocate %zu blocks", bcount);
+		return -1;
+	}
+
+	/* A new disk reads back as zeros */
+	memset(mem, 0, bcount * BLOCK_SIZE);
+
+	ram.mem = mem;
+	ram.bcount = bcount;
+
+	return 0;
+}
+
+static int ram_close(void)
+{
+	/* Everything on a RAM disk is lost when it is closed */
+	free(ram.mem);
+	memset(&ram, 0, sizeof(struct ram_disk));
+
+	return 0;
+}
+
+static size_t ram_count(void)
+{
+	return ram.bcount;
+}
+
+static int ram_write(size_t block, const void *buf)
+{
+	memcpy(ram.mem + block * BLOCK_SIZE, buf, BLOCK_SIZE);
+	return 0;
+}
+
+static int ram_read(size_t block, void *buf)
+{
+	memcpy(buf, ram.mem + block * BLOCK_SIZE, BLOCK_SIZE);
+	return 0;
+}
+
+static int ram_writev(size_t block, const struct iovec *iov, int iovcnt)
+{
+	uint8_t *dst = ram.mem + block * BLOCK_SIZE;
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+static int ram_readv(size_t block, const struct iovec *iov, int iovcnt)
+{
+	const uint8_t *src = ram.mem + block * BLOCK_SIZE;
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(iov[i].iov_base, src, iov[i].iov_len);
+		src += iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+static int ram_flush(void)
+{
+	return 0;
+}
+
+static void *ram_map(size_t block)
+{
+	return ram.mem + block * BLOCK_SIZE;
+}
+
+const struct block_backend block_ram_backend = {
+	.name = "ram",
+	.open = ram_open,
+	.close = ram_close,
+	.count = ram_count,
+	.read = ram_read,
+	.write = ram_write,
+	.readv = ram_readv,
+	.writev = ram_writev,
+	.flush = ram_flush,
+	.map = ram_map,
+	.fd = NULL,
+};
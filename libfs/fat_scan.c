@@ -0,0 +1,127 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "fat_scan.h"
+
+/* Vector kernels are available on x86, unless disabled at build time */
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(FAT_SCAN_NO_SIMD)
+#define HAVE_FAT_SIMD 1
+#include <immintrin.h>
+#endif
+
+/* Entries covered by one bitmap word */
+#define FAT_MASK_ENTRIES 64
+
+/* Returns a mask with bit i set if entry i of the 64 entries at fat is zero */
+typedef uint64_t (*fat_mask_fn)(const uint16_t *fat);
+
+static uint64_t fat_mask_scalar(const uint16_t *fat)
+{
+	uint64_t mask = 0;
+
+	for (int i = 0; i < FAT_MASK_ENTRIES; i++) {
+		if (fat[i] == 0)
+			mask |= 1ULL << i;
+	}
+
+	return mask;
+}
+
+#ifdef HAVE_FAT_SIMD
+/* 16 entries per step: compare 2x8 entries, narrow to bytes, take the signs */
+__attribute__((target("sse2")))
+static uint64_t fat_mask_sse2(const uint16_t *fat)
+{
+	const __m128i zero = _mm_setzero_si128();
+	uint64_t mask = 0;
+
+	for (int i = 0; i < FAT_MASK_ENTRIES; i += 16) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(fat + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(fat + i + 8));
+		__m128i eq = _mm_packs_epi16(_mm_cmpeq_epi16(lo, zero),
+					     _mm_cmpeq_epi16(hi, zero));
+
+		mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(eq) << i;
+	}
+
+	return mask;
+}
+
+/* 32 entries per step, packing works per 128-bit lane so lanes are put back
+in order before taking the signs */
+__attribute__((target("avx2")))
+static uint64_t fat_mask_avx2(const uint16_t *fat)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	uint64_t mask = 0;
+
+	for (int i = 0; i < FAT_MASK_ENTRIES; i += 32) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *)(fat + i));
+		__m256i hi = _mm256_loadu_si256((const __m256i *)(fat + i + 16));
+		__m256i eq = _mm256_packs_epi16(_mm256_cmpeq_epi16(lo, zero),
+						_mm256_cmpeq_epi16(hi, zero));
+
+		eq = _mm256_permute4x64_epi64(eq, 0xD8);
+		mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(eq) << i;
+	}
+
+	return mask;
+}
+#endif
+
+/* Kernel picked for this CPU, on first use */
+static fat_mask_fn fat_mask;
+
+static void fat_scan_select(void)
+{
+	if (fat_mask)
+		return;
+
+	fat_mask = fat_mask_scalar;
+#ifdef HAVE_FAT_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		fat_mask = fat_mask_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		fat_mask = fat_mask_sse2;
+#endif
+}
+
+/* Mask of the zero entries among the last count (< 64) entries */
+static uint64_t fat_mask_tail(const uint16_t *fat, size_t count)
+{
+	uint16_t tail[FAT_MASK_ENTRIES];
+
+	/* Pad with used entries */
+	memcpy(tail, fat, count * sizeof(uint16_t));
+	memset(tail + count, 0xFF, (FAT_MASK_ENTRIES - count) * sizeof(uint16_t));
+
+	return fat_mask(tail);
+}
+
+size_t fat_count_used(const uint16_t *fat, size_t count)
+{
+	size_t used = count;
+	size_t i;
+
+	fat_scan_select();
+
+	for (i = 0; i + FAT_MASK_ENTRIES <= count; i += FAT_MASK_ENTRIES)
+		used -= __builtin_popcountll(fat_mask(fat + i));
+	if (i < count)
+		used -= __builtin_popcountll(fat_mask_tail(fat + i, count - i));
+
+	return used;
+}
+
+void fat_free_map(const uint16_t *fat, size_t count, uint64_t *map)
+{
+	size_t i;
+
+	fat_scan_select();
+
+	for (i = 0; i + FAT_MASK_ENTRIES <= count; i += FAT_MASK_ENTRIES)
+		map[i / FAT_MASK_ENTRIES] = fat_mask(fat + i);
+	if (i < count)
+		map[i / FAT_MASK_ENTRIES] = fat_mask_tail(fat + i, count - i);
+}
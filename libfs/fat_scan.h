@@ -0,0 +1,30 @@
+#ifndef _FAT_SCAN_H
+#define _FAT_SCAN_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * fat_count_used - Count used FAT entries
+ * @fat: FAT entries
+ * @count: Number of entries
+ *
+ * Count the non-zero entries among the first @count entries of @fat, with the
+ * widest vector instructions the CPU supports.
+ *
+ * Return: The number of used entries.
+ */
+size_t fat_count_used(const uint16_t *fat, size_t count);
+
+/**
+ * fat_free_map - Build a bitmap of free FAT entries
+ * @fat: FAT entries
+ * @count: Number of entries
+ * @map: Bitmap of (@count + 63) / 64 words
+ *
+ * Fill @map with one bit per entry of @fat, set if the entry is zero: bit i of
+ * word w stands for entry w * 64 + i. Bits past @count are cleared.
+ */
+void fat_free_map(const uint16_t *fat, size_t count, uint64_t *map);
+
+#endif /* _FAT_SCAN_H */
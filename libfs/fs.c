@@ -1,20 +1,73 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
+#include "cache.h"
 #include "disk.h"
+#include "fat_scan.h"
 #include "fs.h"
 
 /* Macros */
 #define ECS150FS_SIG "ECS150FS"
 #define ECS150FS_SIG_SIZE 8
 
-#define SUPERBLK_PADDING 4079
-#define ROOT_DIR_ENTRY_PADDING 10
+#define SUPERBLK_PADDING 4075
+#define ROOT_DIR_ENTRY_PADDING 8
 
 #define FAT_EOC 0xFFFF
+#define FAT_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+
+/* FAT entries tracked per free-space bitmap word */
+#define FREE_MAP_BITS 64
+
+/* Entries per root directory block */
+#define RDIR_BLOCK_ENTRIES (BLOCK_SIZE / sizeof(struct file))
+/* Root directory free entry bitmap words per block */
+#define RDIR_FREE_MAP_WORDS (RDIR_BLOCK_ENTRIES / 64)
+
+/* Empty root directory hash bucket, and end of a hash chain */
+#define RDIR_NO_ENTRY -1
+
+/* Directory entry types */
+#define FILE_TYPE_REG 0
+#define FILE_TYPE_DIR 1
+
+/* Directory entry flags: the first block of a sparse file is its hole map */
+#define FILE_SPARSE 0x01
+
+/* Hole runs per hole map */
+#define HOLE_MAP_RUNS ((BLOCK_SIZE - 8) / 8)
+
+/* Largest file size, sizes and offsets are returned as int */
+#define FILE_SIZE_MAX INT32_MAX
+
+/* Directory standing for the root directory, other directories are named
+after their first block */
+#define DIR_ROOT FAT_EOC
+
+/* Entries per subdirectory block, hashed on their name */
+#define DIR_SLOTS RDIR_BLOCK_ENTRIES
+
+/* Predecessor of a data block during defragmentation: no predecessor (free or
+lost block), the root directory entry of the file it starts, or the superblock
+for the root directory blocks */
+#define DEFRAG_NO_PREV INT32_MAX
+#define DEFRAG_HEAD(i) (-(i) - 1)
+#define DEFRAG_RDIR_HEAD INT32_MIN
+
+/* Data locks shared by open files, picked from their entry */
+#define FILE_LOCK_STRIPES 64
+
+/* Add n to counter field of stats, from any thread */
+#define stat_add(field, n) \
+	__atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+/* Readahead window bounds, in blocks */
+#define RA_MIN_BLOCKS 4
+#define RA_MAX_BLOCKS 32
 
 /* Structs*/
 typedef struct __attribute__((__packed__)) superblock {
@@ -24,6 +77,10 @@ typedef struct __attribute__((__packed__)) superblock {
 	uint16_t data_blk;
 	uint16_t data_blk_count;
 	uint8_t fat_blk_count;
+	/* Root directory blocks after the first one, chained through the FAT
+	from rdir_ext_index (unused while rdir_ext_count is 0) */
+	uint16_t rdir_ext_index;
+	uint16_t rdir_ext_count;
 	uint8_t padding[SUPERBLK_PADDING];
 } *superblock_t;
 
@@ -31,518 +88,3672 @@ typedef struct __attribute__((__packed__)) file {
 	uint8_t name[FS_FILENAME_LEN];
 	uint32_t size;
 	uint16_t start_index;
+	uint8_t type;
+	uint8_t flags;
 	uint8_t padding[ROOT_DIR_ENTRY_PADDING];
 } *file_t;
 
+/* Run of consecutive data blocks of a file */
+typedef struct extent {
+	/* First file block of the run */
+	uint32_t file_blk;
+	/* First data block of the run */
+	uint16_t start;
+	uint16_t count;
+} extent_t;
+
+/* Run of file blocks without data blocks, which read back as zeros */
+typedef struct __attribute__((__packed__)) hole_run {
+	uint32_t file_blk;
+	uint32_t count;
+} hole_run_t;
+
+/* First block of the chain of a sparse file: its holes by file block. Every
+hole is followed by a block with data */
+typedef struct __attribute__((__packed__)) hole_map {
+	uint32_t count;
+	uint8_t padding[4];
+	hole_run_t runs[HOLE_MAP_RUNS];
+} hole_map_t;
+
+/* Entry of a file open outside the root directory, shared by its file
+descriptors and written back once they are all closed */
+typedef struct open_node {
+	struct file entry;
+	/* Directory holding the entry */
+	uint16_t dir;
+	int refs;
+	int dirty;
+} open_node_t;
+
 typedef struct open_file {
 	file_t file;
+	/* Root directory entry of file, or -1 if file is held by node */
+	int rdir_index;
+	int node;
 	uint32_t offset;
+	/* Data blocks of the file, NULL to follow the FAT chain instead */
+	extent_t *extents;
+	size_t extent_count;
+	size_t extent_cap;
+	/* Offset a sequential read would continue from */
+	uint32_t ra_next;
+	/* Number of blocks to prefetch, grows while reads are sequential */
+	size_t ra_window;
+	/* Prefetched blocks, from file block ra_start */
+	char *ra_buf;
+	size_t ra_start;
+	size_t ra_count;
+	/* Small writes gathered from file offset wb_offset, up to the end of its
+	block. The file offset is already past them */
+	char *wb_buf;
+	uint32_t wb_offset;
+	size_t wb_len;
+	/* Holes of a sparse file, NULL for other files */
+	hole_map_t *holes;
 } open_file_t;
 
+/* Position in the buffers of an I/O vector, used one after the other */
+typedef struct iov_pos {
+	const struct iovec *iov;
+	/* Bytes of iov[0] already used */
+	size_t offset;
+} iov_pos_t;
+
 /* Global Variables */
 superblock_t superblock;
-file_t rdir;
+/* Root directory blocks, and the disk block each one is stored in */
+file_t *rdir_blocks;
+uint16_t *rdir_blk_index;
+size_t rdir_blk_count;
+/* Number of root directory entries */
+size_t rdir_count;
 open_file_t open_files[FS_OPEN_MAX_COUNT];
 uint16_t *fat;
 uint8_t open_file_count;
+struct fs_stats stats;
+/* Free-space bitmap, one bit set per free FAT entry */
+uint64_t *free_map;
+size_t free_map_words;
+/* No free entry is tracked by the words before free_hint */
+size_t free_hint;
+/* Metadata blocks modified since they were last written: one flag per FAT
+block and per root directory block, and one for the superblock */
+uint8_t *fat_dirty;
+uint8_t *rdir_dirty;
+int superblock_dirty;
+/* Root directory entries by name hash, chained through rdir_hnext */
+int32_t *rdir_buckets;
+size_t rdir_nbuckets;
+int32_t *rdir_hnext;
+/* Free root directory entries, one bit set per entry */
+uint64_t *rdir_free_map;
+/* No free entry is tracked by the words before rdir_free_hint */
+size_t rdir_free_hint;
+/* Number of file descriptors open on each root directory entry */
+uint8_t *rdir_open_count;
+/* Free file descriptors, one bit set per descriptor */
+uint64_t open_free_map;
+/* Entries of files open outside the root directory */
+open_node_t open_nodes[FS_OPEN_MAX_COUNT];
+/* Hole maps of the sparse files open, by file descriptor */
+hole_map_t hole_maps[FS_OPEN_MAX_COUNT];
+/* Hole map being changed, metadata lock held exclusively */
+hole_map_t hole_scratch;
+/* Free data blocks and root directory entries */
+size_t free_blk_count;
+size_t free_file_count;
+
+/* Metadata lock: held shared by lookups and accesses to file data, and
+exclusively by anything allocating blocks or changing directories */
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+/* Data locks, see open_lock() */
+pthread_rwlock_t file_locks[FILE_LOCK_STRIPES] = {
+	[0 ... FILE_LOCK_STRIPES - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+/* File descriptor locks, for offsets and readahead state */
+pthread_mutex_t fd_locks[FS_OPEN_MAX_COUNT] = {
+	[0 ... FS_OPEN_MAX_COUNT - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+/* Protects open_nodes and the directory blocks node_write() updates under
+the shared metadata lock */
+pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
 
 
 /* Internal Functions */
-/* Check if valid filename (null terminated and <16) */
-int valid_filename(const char *filename) 
-{
-	int valid_name = 0;
-
-	for (int i = 0; i < FS_FILENAME_LEN; i++) {
-		if (filename[i] == '\0') {
-			valid_name = 1;
-			break;
-		}
-	}
-
-	return valid_name;
-}
-
 /* Check if fd is valid */
 int valid_fd(int fd)
 {
 	/* Check if fd is in bounds */
-	if (fd < 0 || fd >= FS_FILE_MAX_COUNT) 
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT) 
 		return 0;
 
-	/* Check if fd is valid */
-	if (open_files[fd].file == NULL)
+	/* Check if fd is valid, descriptors are published once set up */
+	if (__atomic_load_n(&open_files[fd].file, __ATOMIC_ACQUIRE) == NULL)
 		return 0;
 
 	return 1;
 }
 
-/* Returns -1 if fat is full, otherwise returns first free fat starting at
-start_index + 1 */
-int fat_find_free(int start_index) 
-{
-	for (int i = (start_index + 1); i < superblock->data_blk_count; i++) {
-		if (fat[i] == 0) {
-			return i;
-		}
-	}
-	
-	/* if no empty fat entry found */
-	return FAT_EOC;
-}
-
-/* Returns the fat index of the open_file with offset*/
-int fat_find_index(open_file_t open_file) 
+/* Build the free-space bitmap from the FAT */
+int free_map_build(void)
 {
-	int fat_offset = open_file.offset / BLOCK_SIZE;
-	int fat_index = open_file.file->start_index;
-
-	for (int i = 0; i < fat_offset; i++) {
-		fat_index = fat[fat_index];
-	}
+	free_map_words = (superblock->data_blk_count + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+	free_map = (uint64_t*) calloc(free_map_words, sizeof(uint64_t));
+	if (free_map == NULL)
+		return -1;
 
-	return fat_index;
-}
+	/* Entry 0 is reserved, even if it reads as free */
+	fat_free_map(fat, superblock->data_blk_count, free_map);
+	free_map[0] &= ~1ULL;
+	free_hint = 0;
 
-/* Wrapper reading function to add data block start offset */
-int data_block_read(size_t block, void *buf)
-{
-	return block_read(block + superblock->data_blk, buf);
+	return 0;
 }
 
-/* Wrapper writing function to add data block start offset */
-int data_block_write(size_t block, void *buf)
+/* Set fat entry at index to value, keeping the free-space bitmap in sync */
+void fat_set(uint16_t index, uint16_t value)
 {
-	return block_write(block + superblock->data_blk, buf);
+	size_t word = index / FREE_MAP_BITS;
+	uint64_t bit = 1ULL << (index % FREE_MAP_BITS);
+
+	/* Count blocks changing hands */
+	if (fat[index] == 0 && value != 0)
+		free_blk_count--;
+	else if (fat[index] != 0 && value == 0)
+		free_blk_count++;
+
+	fat[index] = value;
+	fat_dirty[index / FAT_PER_BLOCK] = 1;
+	if (value == 0) {
+		free_map[word] |= bit;
+		if (word < free_hint)
+			free_hint = word;
+	} else {
+		free_map[word] &= ~bit;
+	}
 }
 
-/* Returns the index of open_files with file of filename, returns -1 if
-not found */
-int open_find_file(const char *filename) 
+/* Returns the first entry from index on which is free, or used if free is 0.
+Returns data_blk_count if there is none */
+size_t free_map_next(size_t index, int free)
 {
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
-		if (open_files[i].file != NULL ) {
-			if (strcmp((char*)open_files[i].file->name,filename) == 0)
-				return i;
-		} else if (strcmp(filename,"") == 0) {
-			return i;
-		}
+	size_t word = index / FREE_MAP_BITS;
+	uint64_t bits;
+
+	if (word >= free_map_words)
+		return superblock->data_blk_count;
+
+	bits = free ? free_map[word] : ~free_map[word];
+	bits &= ~0ULL << (index % FREE_MAP_BITS);
+	stat_add(fat_scan_entries, 1);
+	while (bits == 0) {
+		if (++word == free_map_words)
+			return superblock->data_blk_count;
+		bits = free ? free_map[word] : ~free_map[word];
+		stat_add(fat_scan_entries, 1);
 	}
-	
-	/* if no filed of filename match is opened */
-	return -1;
-}
 
-/* Returns the index of the root directory with file of filename, returns -1 if
-not found */
-int rdir_find_file(const char *filename) {
-	int index = -1;
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp((char*)rdir[i].name,filename) == 0) {
-			index = i;
-			break;
-		}
-	}
-	return index;
+	index = word * FREE_MAP_BITS + __builtin_ctzll(bits);
+	return (index < superblock->data_blk_count) ? index : superblock->data_blk_count;
 }
 
-/* Resize block allocation to allow file to contain size bytes and returns the
-actual resize value if disk is full and not able resize to size*/
-int file_resize(open_file_t open_file, int size)
+/* Find a run of free entries to chain after entry last (FAT_EOC for a file
+without blocks), ideally want entries long. The entries right after last are
+preferred, then the first run long enough, then the longest run. Returns the
+first entry of the run, or FAT_EOC if fat is full, and its length in len */
+int fat_find_run(uint16_t last, size_t want, size_t *len)
 {
-	int old_blk_count = (open_file.file->size - 1) / BLOCK_SIZE;
-	if(open_file.file->size == 0) {
-		old_blk_count = 0;
+	size_t index;
+	size_t best = FAT_EOC;
+	size_t best_len = 0;
+
+	stat_add(fat_scans, 1);
+
+	/* Keep growing in place */
+	if (last != FAT_EOC && last + 1 < superblock->data_blk_count &&
+	    fat[last + 1] == 0) {
+		index = last + 1;
+		*len = free_map_next(index, 0) - index;
+		if (*len > want)
+			*len = want;
+		return index;
 	}
-	int new_blk_count = (size - 1) / BLOCK_SIZE;
-	int fat_index = open_file.file->start_index + old_blk_count;
 
-	fat[fat_index] = fat_find_free(0);
-	for (int i = old_blk_count; i < new_blk_count; i++) {
-		fat_index = fat[fat_index];
-		fat[fat_index] = fat_find_free(fat_index);
-		if (fat[fat_index] == FAT_EOC) {
-			open_file.file->size = (i+1) * BLOCK_SIZE;
-			return ((i+1) * BLOCK_SIZE);
+	/* Words before free_hint are full */
+	index = free_hint * FREE_MAP_BITS;
+	while ((index = free_map_next(index, 1)) < superblock->data_blk_count) {
+		size_t end = free_map_next(index, 0);
+
+		if (end - index >= want) {
+			*len = want;
+			return index;
+		}
+		if (end - index > best_len) {
+			best = index;
+			best_len = end - index;
 		}
+		index = end;
 	}
 
-	fat[fat_index] = FAT_EOC;
-	open_file.file->size = size;
-	return size;
+	*len = best_len;
+	return best;
 }
 
-/***** API Functions *****/
-int fs_mount(const char *diskname)
+/* Returns FAT_EOC if fat is full, otherwise returns first free fat starting at
+start_index + 1 */
+int fat_find_free(int start_index) 
 {
-	char sig_check[ECS150FS_SIG_SIZE + 1];
+	size_t word = (start_index + 1) / FREE_MAP_BITS;
+	uint64_t bits;
+
+	stat_add(fat_scans, 1);
+
+	/* Skip the words known to be full */
+	if (word < free_hint) {
+		word = free_hint;
+		bits = free_map[word];
+	} else if (word < free_map_words) {
+		bits = free_map[word] & (~0ULL << ((start_index + 1) % FREE_MAP_BITS));
+	} else {
+		return FAT_EOC;
+	}
 
-	/* Open Disk */
-	if (block_disk_open(diskname) == -1) 
-		return -1;
+	/* Skip full words, 64 entries at a time */
+	while (bits == 0) {
+		stat_add(fat_scan_entries, 1);
+		if (++word == free_map_words)
+			return FAT_EOC;
+		bits = free_map[word];
+	}
+	stat_add(fat_scan_entries, 1);
 
-	/* Read superblock*/
-	superblock = (superblock_t) malloc(sizeof(uint8_t)*BLOCK_SIZE);
-	if (block_read(0, superblock) == -1)
-		return -1;
+	/* Entry 0 is never free, so nothing before the word found is either */
+	if (start_index == 0)
+		free_hint = word;
 
-	/* Check signature */
-	memcpy(sig_check,superblock->signature, ECS150FS_SIG_SIZE);
-	sig_check[ECS150FS_SIG_SIZE] = '\0';
-	if (strcmp(ECS150FS_SIG, sig_check) != 0)
-		return -1;
+	return word * FREE_MAP_BITS + __builtin_ctzll(bits);
+}
 
-	/* Check block count */
-	if (block_disk_count() != superblock->total_blk_count)
-		return -1;
+/* Map file block file_blk onto data block fat_index in the extents of
+open_file. Returns -1 if the extents could not grow */
+int extent_append(open_file_t *open_file, size_t file_blk, uint16_t fat_index)
+{
+	extent_t *last = open_file->extent_count ?
+		&open_file->extents[open_file->extent_count - 1] : NULL;
 
-	/* Read root directory */
-	rdir = (file_t) malloc(sizeof(uint8_t)*BLOCK_SIZE);
-	if (block_read((superblock->data_blk-1), rdir) == -1)
-		return -1;
+	/* Extend the last run if the block follows it on disk */
+	if (last && last->file_blk + last->count == file_blk &&
+	    last->start + last->count == fat_index) {
+		last->count++;
+		return 0;
+	}
 
-	/* Read FAT array */
-	fat = (uint16_t*) malloc(sizeof(uint16_t)*BLOCK_SIZE*superblock->fat_blk_count);
-	for (int i = 0; i < superblock->fat_blk_count; i++) {
-		block_read(1 + i, fat + (i * BLOCK_SIZE));
+	if (open_file->extent_count == open_file->extent_cap) {
+		size_t cap = open_file->extent_cap ? open_file->extent_cap * 2 : 4;
+		extent_t *extents = (extent_t*) realloc(open_file->extents,
+							sizeof(extent_t) * cap);
+		if (extents == NULL)
+			return -1;
+		open_file->extents = extents;
+		open_file->extent_cap = cap;
 	}
 
-	/* Clear Open File Array */
-	memset(open_files,0, sizeof(open_file_t) * FS_OPEN_MAX_COUNT);
-	open_file_count = 0;
+	last = &open_file->extents[open_file->extent_count++];
+	last->file_blk = file_blk;
+	last->start = fat_index;
+	last->count = 1;
 
 	return 0;
 }
 
-int fs_umount(void)
+/* Drop the extents of open_file, its blocks are then found along the FAT
+chain */
+void extent_drop(open_file_t *open_file)
 {
-	/* Check for open files */
-	if (open_file_count != 0) 
-		return -1;
+	free(open_file->extents);
+	open_file->extents = NULL;
+	open_file->extent_count = 0;
+	open_file->extent_cap = 0;
+}
 
-	/* Write out the metadata */
-	if (block_write(0, superblock) == -1)
-		return -1;
-	if (block_write((superblock->data_blk-1), rdir) == -1)
-		return -1;
-	for (int i = 0; i < superblock->fat_blk_count; i++) {
-		block_write(1 + i, fat + (i * BLOCK_SIZE));
-	}
+/* Build the extents of open_file from its FAT chain */
+void extent_build(open_file_t *open_file)
+{
+	const hole_map_t *holes = open_file->holes;
+	uint16_t fat_index = open_file->file->start_index;
+	size_t file_blk = 0;
+	size_t run = 0;
 
-	/* Close the Disk */
-	if (block_disk_close() == -1)
-		return -1;
+	/* The hole map of a sparse file is not part of its data */
+	if (holes)
+		fat_index = fat[fat_index];
 
-	/* Free metadata structures */
-	free(superblock);
-	free(rdir);
-	free(fat);
-	return 0;
+	stat_add(fat_walks, 1);
+	while (fat_index != FAT_EOC) {
+		stat_add(fat_walk_entries, 1);
+		while (holes && run < holes->count &&
+		       holes->runs[run].file_blk == file_blk)
+			file_blk += holes->runs[run++].count;
+		if (extent_append(open_file, file_blk++, fat_index) == -1) {
+			extent_drop(open_file);
+			return;
+		}
+		fat_index = fat[fat_index];
+	}
+
+	/* Files without blocks still get a map, for file_chain to extend */
+	if (open_file->extents == NULL) {
+		open_file->extents = (extent_t*) malloc(sizeof(extent_t) * 4);
+		if (open_file->extents != NULL)
+			open_file->extent_cap = 4;
+	}
 }
 
-int fs_info(void)
+/* Returns the data block holding file block file_blk of open_file, or FAT_EOC
+past the end of its chain */
+uint16_t fat_find_block(const open_file_t *open_file, size_t file_blk)
 {
-	int file_count = 0;
-	int fat_count = 0;
+	uint16_t fat_index = open_file->file->start_index;
+	size_t lo = 0;
+	size_t hi = open_file->extent_count;
+
+	/* No extents, follow the FAT chain past the holes before file_blk */
+	if (open_file->extents == NULL) {
+		size_t chain_blk = file_blk;
+
+		if (open_file->holes) {
+			const hole_map_t *holes = open_file->holes;
+
+			fat_index = fat[fat_index];
+			for (size_t i = 0; i < holes->count; i++) {
+				if (file_blk < holes->runs[i].file_blk)
+					break;
+				if (file_blk < holes->runs[i].file_blk +
+					       holes->runs[i].count)
+					return FAT_EOC;
+				chain_blk -= holes->runs[i].count;
+			}
+		}
 
-	if(block_disk_count() == -1)
-		return -1;
+		stat_add(fat_walks, 1);
+		for (size_t i = 0; i < chain_blk && fat_index != FAT_EOC; i++) {
+			stat_add(fat_walk_entries, 1);
+			fat_index = fat[fat_index];
+		}
+		return fat_index;
+	}
 
-	/* FS Info: */
-	printf("FS Info:\n"); 
+	/* Binary search for the last extent starting at or before file_blk */
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
 
-	/* total_blk_count= */
-	printf("total_blk_count=%d\n", superblock->total_blk_count);
+		if (open_file->extents[mid].file_blk <= file_blk)
+			lo = mid;
+		else
+			hi = mid;
+	}
 
-	/* fat_blk_count= */
-	printf("fat_blk_count=%d\n", superblock->fat_blk_count);
+	if (hi == 0 || file_blk >= open_file->extents[lo].file_blk +
+				   open_file->extents[lo].count)
+		return FAT_EOC;
 
-	/* rdir_blk= */
-	printf("rdir_blk=%d\n", (superblock->data_blk - 1));
+	return open_file->extents[lo].start +
+	       (file_blk - open_file->extents[lo].file_blk);
+}
 
-	/* data_blk= */
-	printf("data_blk=%d\n", superblock->data_blk);
+/* Returns the number of file blocks of open_file up to its last data block,
+holes included, which can be more than its size needs after fs_fallocate() */
+size_t file_alloc_count(const open_file_t *open_file)
+{
+	uint16_t fat_index = open_file->file->start_index;
+	size_t count = 0;
 
-	/* data_blk_count= */
-	printf("data_blk_count=%d\n", superblock->data_blk_count);
+	if (open_file->extents != NULL) {
+		const extent_t *last;
 
-	/* fat_free_ratio=x/4096 */
-	for (int i = 0; i < superblock->data_blk_count; i++) {
-		if (fat[i] != 0) {
-			fat_count++;
-		}
+		if (open_file->extent_count == 0)
+			return 0;
+		last = &open_file->extents[open_file->extent_count - 1];
+		return last->file_blk + last->count;
 	}
-	printf("fat_free_ratio=%d/%d\n", superblock->data_blk_count - fat_count, superblock->data_blk_count);
 
-	/* rdir_free_ratio=x/128 */
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (rdir[i].name[0] != '\0') {
-			file_count++;
-		}
+	/* Holes all come before the last data block, the hole map does not
+	count */
+	if (open_file->holes) {
+		fat_index = fat[fat_index];
+		for (size_t i = 0; i < open_file->holes->count; i++)
+			count += open_file->holes->runs[i].count;
 	}
-	printf("rdir_free_ratio=%d/%d\n", FS_FILE_MAX_COUNT - file_count, FS_FILE_MAX_COUNT);
-	
-	return 0;
+
+	stat_add(fat_walks, 1);
+	while (fat_index != FAT_EOC) {
+		stat_add(fat_walk_entries, 1);
+		fat_index = fat[fat_index];
+		count++;
+	}
+
+	return count;
 }
 
-int fs_create(const char *filename)
+/* Returns the number of file blocks of open_file from file_blk on that are
+all holes if hole is set, or that all have data blocks, chained one after the
+other. Blocks past the last data block are holes */
+size_t open_span(const open_file_t *open_file, size_t file_blk, int *hole)
 {
-	int empty_index = -1;
-	int fat_index = 0;
+	const hole_map_t *holes = open_file->holes;
+	size_t alloc_count = file_alloc_count(open_file);
 
-	/* Valid name check */
-	if (!valid_filename(filename))
-		return -1;
-
-	/*
-	 * - Checks if filename already exists
-	 * - Finds a free entry index if it doesn't exists
-	 */
-	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (strcmp((char*)rdir[i].name,filename) == 0)
-			return -1;
-		if (rdir[i].name[0] == '\0' && empty_index == -1)
-			empty_index = i;
-	}
+	*hole = 1;
+	if (file_blk >= alloc_count)
+		return SIZE_MAX;
 
-	/* Check if maximum files created */
-	if (empty_index == -1)
-		return -1;
+	for (size_t i = 0; holes && i < holes->count; i++) {
+		const hole_run_t *run = &holes->runs[i];
 
-	/* Check for full disk */
-	fat_index = fat_find_free(0);
-	if (fat_index == FAT_EOC)
-		return -1;
+		/* Data blocks up to the next hole */
+		if (file_blk < run->file_blk) {
+			*hole = 0;
+			return run->file_blk - file_blk;
+		}
+		if (file_blk < run->file_blk + run->count)
+			return run->file_blk + run->count - file_blk;
+	}
 
-	/* Create a new file */
-	memset(&(rdir[empty_index]),0,BLOCK_SIZE/FS_FILE_MAX_COUNT);
-	strcpy((char*)rdir[empty_index].name,filename);
-	rdir[empty_index].start_index = fat_index;
-	fat[fat_index] = FAT_EOC;
-	
-	return 0;
+	*hole = 0;
+	return alloc_count - file_blk;
 }
 
-int fs_delete(const char *filename)
+/* Returns 1 if every block of open_file holding bytes from offset to offset +
+count has a data block, 0 otherwise */
+int open_mapped(const open_file_t *open_file, size_t offset, size_t count)
 {
-	int del_index = -1;
-	uint16_t del_block = 0;
+	size_t first_blk = offset / BLOCK_SIZE;
+	size_t blk_count;
+	int hole;
 
-	/* Valid name check */
-	if (!valid_filename(filename))
-		return -1;
+	if (count == 0)
+		return 1;
 
-	/* Check if file is open */
-	if (open_find_file(filename) != -1)
-		return -1;
+	blk_count = (offset % BLOCK_SIZE + count + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-	/* Check if file exists and find index*/
-	del_index = rdir_find_file(filename);
-	if (del_index == -1)
-		return -1;
+	return open_span(open_file, first_blk, &hole) >= blk_count && !hole;
+}
 
-	/* Delete the file */
-	del_block = rdir[del_index].start_index;
-	while (del_block != FAT_EOC) {
-		uint16_t temp_block = fat[del_block];
-		fat[del_block] = 0;
-		del_block = temp_block;
+/* Map file block file_blk onto data block fat_index for every open file
+descriptor of file */
+void open_extend_extents(file_t file, size_t file_blk, uint16_t fat_index)
+{
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (open_files[i].file != file || open_files[i].extents == NULL)
+			continue;
+		/* Fall back to the FAT chain rather than keep a stale map */
+		if (extent_append(&open_files[i], file_blk, fat_index) == -1)
+			extent_drop(&open_files[i]);
 	}
-	memset(&(rdir[del_index]),0,BLOCK_SIZE/FS_FILE_MAX_COUNT);
+}
 
-	return 0;
+/* Wrapper reading function to add data block start offset */
+int data_block_read(size_t block, void *buf)
+{
+	return cache_read(block + superblock->data_blk, buf);
 }
 
-int fs_ls(void)
+/* Wrapper writing function to add data block start offset */
+int data_block_write(size_t block, void *buf)
 {
-	if(block_disk_count() == -1)
-		return -1;
+	return cache_write(block + superblock->data_blk, buf);
+}
 
-	/* FS Ls: */
-	printf("FS Ls:\n");
+/* Drop the prefetched blocks of every open file descriptor of file */
+void open_drop_readahead(file_t file)
+{
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (__atomic_load_n(&open_files[i].file, __ATOMIC_ACQUIRE) == file)
+			open_files[i].ra_count = 0;
+	}
+}
 
-	/* Iterate though rdir and print file w/ info */
-	for ( int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (rdir[i].name[0] != 0) {
-			/* file: */
-			printf("file: %s, ", (char*)rdir[i].name);
-			/* size: */
-			printf("size: %u, ", rdir[i].size);
-			/* data_blk: */
-			printf("data_blk: %u\n", rdir[i].start_index);
-		}
+/* Returns 1 if a file descriptor of file other than skip_fd has buffered
+writes, 0 otherwise */
+int open_write_pending(file_t file, int skip_fd)
+{
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (i != skip_fd &&
+		    __atomic_load_n(&open_files[i].file, __ATOMIC_ACQUIRE) == file &&
+		    __atomic_load_n(&open_files[i].wb_len, __ATOMIC_RELAXED))
+			return 1;
 	}
 
 	return 0;
 }
 
-int fs_open(const char *filename)
+/* Claim the lowest free file descriptor, or return -1 if all are in use.
+Threads opening files concurrently each get their own descriptor without
+taking a lock */
+int open_claim(void)
 {
-	int open_index = -1;
-	int rdir_index = -1;
+	uint64_t map = __atomic_load_n(&open_free_map, __ATOMIC_RELAXED);
 
-	/* Check number of open files */
-	if (open_file_count == FS_OPEN_MAX_COUNT) 
-		return -1;
+	_Static_assert(FS_OPEN_MAX_COUNT <= 64, "file descriptors exceed mask");
 
-	/* Valid name check */
-	if (!valid_filename(filename))
-		return -1;
+	while (map != 0) {
+		int fd = __builtin_ctzll(map);
 
-	/* Check if file exists */
-	rdir_index = rdir_find_file(filename);
-	if (rdir_index == -1)
-		return -1;
+		if (__atomic_compare_exchange_n(&open_free_map, &map,
+						map & ~(1ULL << fd), 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return fd;
+	}
 
-	/* Find first empty spot in open_files */
-	open_index = open_find_file("");
-	open_files[open_index].file = &(rdir[rdir_index]);
-	open_files[open_index].offset = 0;
-	
-	/* Increment open file count */
-	open_file_count++;
+	return -1;
+}
 
-	return open_index;
+/* Give file descriptor fd back */
+void open_release(int fd)
+{
+	__atomic_fetch_or(&open_free_map, 1ULL << fd, __ATOMIC_RELEASE);
 }
 
-int fs_close(int fd)
+/* Returns the data lock of the file open_file is open on. Descriptors of a
+same file share its entry, and so its lock */
+pthread_rwlock_t *open_lock(const open_file_t *open_file)
 {
-	/* Check if fd is valid */
-	if (!valid_fd(fd)) 
-		return -1;
+	uintptr_t key = (uintptr_t)open_file->file / sizeof(struct file);
 
-	/* Close file */
-	memset(&open_files[fd],0,sizeof(open_file_t));
+	return &file_locks[key % FILE_LOCK_STRIPES];
+}
 
-	open_file_count--;
-	return 0;
+/* Returns root directory entry index */
+file_t rdir_entry(int index)
+{
+	return &rdir_blocks[index / RDIR_BLOCK_ENTRIES][index % RDIR_BLOCK_ENTRIES];
 }
 
-int fs_stat(int fd)
+/* Flag the root directory block of entry index as modified */
+void rdir_mark_dirty(int index)
 {
-	/* Check if fd is valid */
-	if (!valid_fd(fd)) 
-		return -1;
+	rdir_dirty[index / RDIR_BLOCK_ENTRIES] = 1;
+}
 
-	/* Return size of file */
-	return open_files[fd].file->size;
+/* Hash of a file name (FNV-1a) */
+uint32_t name_hash(const char *filename)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*filename) {
+		hash ^= (uint8_t)*filename++;
+		hash *= 16777619u;
+	}
+
+	return hash;
 }
 
-int fs_lseek(int fd, size_t offset)
+/* Root directory hash bucket of a file name */
+uint32_t rdir_hash(const char *filename)
 {
-	/* Check if fd is valid */
-	if (!valid_fd(fd)) 
-		return -1;
+	return name_hash(filename) & (rdir_nbuckets - 1);
+}
 
-	/* Check if offset is within bounds of file */
-	if (offset < 0 || offset >= open_files[fd].file->size)
-		return -1;
+/* Flag the entry of open_file as modified */
+void file_mark_dirty(const open_file_t *open_file)
+{
+	if (open_file->rdir_index >= 0)
+		rdir_mark_dirty(open_file->rdir_index);
+	else
+		open_nodes[open_file->node].dirty = 1;
+}
 
-	/* Set open file offest */
-	open_files[fd].offset = offset;
+/* Add root directory entry index to the name index */
+void rdir_index_insert(int index)
+{
+	uint32_t bucket = rdir_hash((char*)rdir_entry(index)->name);
 
-	return 0;
+	rdir_hnext[index] = rdir_buckets[bucket];
+	rdir_buckets[bucket] = index;
+	rdir_free_map[index / 64] &= ~(1ULL << (index % 64));
 }
 
-int fs_write(int fd, void *buf, size_t count)
+/* Remove root directory entry index from the name index */
+void rdir_index_remove(int index)
 {
-	char *blk_buf;
-	char *buf_copy;
-	size_t blk_count;
-	size_t blk_index;
-	size_t byte_count;
-	size_t byte_rem;
-	size_t byte_offset;
-	open_file_t write_file;
+	int32_t *link = &rdir_buckets[rdir_hash((char*)rdir_entry(index)->name)];
+
+	while (*link != index)
+		link = &rdir_hnext[*link];
+	*link = rdir_hnext[index];
+	rdir_free_map[index / 64] |= 1ULL << (index % 64);
+	if (index / 64 < rdir_free_hint)
+		rdir_free_hint = index / 64;
+}
 
-	/* Check if fd is valid */
-	if (!valid_fd(fd)) 
+/* Index the files of the root directory in nbuckets hash buckets */
+int rdir_index_rehash(size_t nbuckets)
+{
+	int32_t *buckets = (int32_t*) malloc(sizeof(int32_t) * nbuckets);
+
+	if (buckets == NULL)
 		return -1;
 
-	/* Setup blk writing variables */
-	buf_copy = (char*) buf;
-	write_file = open_files[fd];
-	byte_count = count;
-	blk_index = fat_find_index(write_file);
+	free(rdir_buckets);
+	rdir_buckets = buckets;
+	rdir_nbuckets = nbuckets;
+	for (size_t i = 0; i < nbuckets; i++)
+		rdir_buckets[i] = RDIR_NO_ENTRY;
 
-	/* Check if file needs to be extended */
-	if (byte_count + write_file.offset > write_file.file->size) {
-		int actual_resize = file_resize(write_file, byte_count + write_file.offset);
-		byte_count = actual_resize - write_file.offset;
+	for (size_t i = 0; i < rdir_count; i++) {
+		if (rdir_entry(i)->name[0] != '\0')
+			rdir_index_insert(i);
 	}
 
-	/* Setup variables */
-	blk_count = byte_count / BLOCK_SIZE + 1;
-	byte_offset = write_file.offset % BLOCK_SIZE;
-	blk_buf = (char*) malloc(sizeof(char) * BLOCK_SIZE);
-
-	/* Read first block and modify at offset */
-	data_block_read(blk_index, blk_buf);
-	memcpy((blk_buf + byte_offset), buf_copy, (BLOCK_SIZE - byte_offset));
-	data_block_write(blk_index, blk_buf);
-
-	/* Write to full data blocks from (1 to blk_count - 1) */
-	buf_copy += (BLOCK_SIZE - byte_offset);
-	blk_index = fat[blk_index];
-	for (int i = 1; i < (blk_count-1); i++) {
-		data_block_write(blk_index, buf_copy);
-		buf_copy += BLOCK_SIZE;
-		blk_index = fat[blk_index];
-	}
+	return 0;
+}
 
-	/* Write to last block */
-	if (blk_index != FAT_EOC) {
-		byte_rem = (byte_count + write_file.offset) % BLOCK_SIZE;
-		data_block_read(blk_index, blk_buf);
-		memcpy(blk_buf, buf_copy, byte_rem);
-		data_block_write(blk_index, blk_buf);
-	}
+/* Returns the number of hash buckets for count entries */
+size_t rdir_index_buckets(size_t count)
+{
+	size_t nbuckets = 1;
 
-	/* Modify offset */
-	write_file.offset += byte_count;
+	while (nbuckets < 2 * count)
+		nbuckets <<= 1;
 
-	return byte_count;
+	return nbuckets;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+/* Build the name index and free entry map of the root directory */
+int rdir_index_build(void)
 {
-	char *blk_buf;
-	size_t blk_count;
-	size_t blk_index;
-	size_t byte_count;
-	size_t byte_rem;
+	for (size_t i = 0; i < rdir_count; i++) {
+		if (rdir_entry(i)->name[0] == '\0')
+			rdir_free_map[i / 64] |= 1ULL << (i % 64);
+	}
+	rdir_free_hint = 0;
+
+	return rdir_index_rehash(rdir_index_buckets(rdir_count));
+}
+
+/* Returns the lowest free root directory entry, or -1 if all are in use */
+int rdir_find_free(void)
+{
+	for (size_t i = rdir_free_hint; i < rdir_count / 64; i++) {
+		if (rdir_free_map[i]) {
+			rdir_free_hint = i;
+			return i * 64 + __builtin_ctzll(rdir_free_map[i]);
+		}
+	}
+	rdir_free_hint = rdir_count / 64;
+
+	return -1;
+}
+
+/* Returns the index of the root directory with file of filename, returns -1 if
+not found */
+int rdir_find_file(const char *filename) {
+	int index = rdir_buckets[rdir_hash(filename)];
+
+	stat_add(dir_scans, 1);
+	while (index != RDIR_NO_ENTRY) {
+		stat_add(dir_scan_entries, 1);
+		if (strcmp((char*)rdir_entry(index)->name,filename) == 0)
+			break;
+		index = rdir_hnext[index];
+	}
+
+	return index;
+}
+
+/* Returns the last block of the chain of open_file, which has alloc_count
+file blocks, or FAT_EOC if it has no block at all */
+uint16_t file_last_block(const open_file_t *open_file, size_t alloc_count)
+{
+	if (alloc_count > 0)
+		return fat_find_block(open_file, alloc_count - 1);
+
+	/* Nothing but the hole map */
+	if (open_file->holes)
+		return open_file->file->start_index;
+
+	return FAT_EOC;
+}
+
+/* Chain up to blk_count free blocks to open_file for file blocks from file_blk
+on, after block last (FAT_EOC for the start of the chain) and in front of what
+followed it, in as few runs as possible. Blocks chained at the end extend the
+extents of the file, others leave them to be built again. Returns the number
+of blocks chained */
+size_t file_chain(const open_file_t *open_file, uint16_t last, size_t file_blk,
+		  size_t blk_count)
+{
+	uint16_t next = (last == FAT_EOC) ? open_file->file->start_index :
+			fat[last];
+	size_t want = blk_count;
+	size_t added = 0;
+
+	while (added < blk_count) {
+		size_t len;
+		int start;
+
+		if (want > blk_count - added)
+			want = blk_count - added;
+		start = fat_find_run(last, want, &len);
+		if (start == FAT_EOC)
+			break;
+
+		/* No run is longer than the longest one found */
+		if (start != last + 1 && len < want)
+			want = len;
+
+		for (size_t i = 0; i < len; i++) {
+			uint16_t fat_index = start + i;
+
+			fat_set(fat_index, next);
+			if (last == FAT_EOC) {
+				open_file->file->start_index = fat_index;
+				file_mark_dirty(open_file);
+			} else {
+				fat_set(last, fat_index);
+			}
+			if (next == FAT_EOC)
+				open_extend_extents(open_file->file,
+						    file_blk + added, fat_index);
+			last = fat_index;
+			added++;
+		}
+	}
+
+	return added;
+}
+
+/* Returns the number of consecutive data blocks, at most max_count, found
+along the FAT chain from fat_index */
+size_t fat_run_length(uint16_t fat_index, size_t max_count)
+{
+	size_t run = 1;
+
+	while (run < max_count && fat[fat_index] == fat_index + 1) {
+		fat_index++;
+		run++;
+	}
+
+	return run;
+}
+
+/* Returns the address of the next byte at pos, and sets len to the number of
+bytes following it in the same buffer. At least one byte must be left */
+char *iov_pos_ptr(iov_pos_t *pos, size_t *len)
+{
+	/* Skip used up and empty buffers */
+	while (pos->offset == pos->iov->iov_len) {
+		pos->iov++;
+		pos->offset = 0;
+	}
+
+	*len = pos->iov->iov_len - pos->offset;
+	return (char*)pos->iov->iov_base + pos->offset;
+}
+
+/* Copy n bytes of src to the buffers at pos, or zeros if src is NULL, and move
+pos past them */
+void iov_pos_put(iov_pos_t *pos, const char *src, size_t n)
+{
+	while (n > 0) {
+		size_t len;
+		char *dst = iov_pos_ptr(pos, &len);
+
+		if (len > n)
+			len = n;
+		if (src) {
+			memcpy(dst, src, len);
+			src += len;
+		} else {
+			memset(dst, 0, len);
+		}
+		pos->offset += len;
+		n -= len;
+	}
+}
+
+/* Copy n bytes from the buffers at pos to dst, or none if dst is NULL, and
+move pos past them */
+void iov_pos_get(iov_pos_t *pos, char *dst, size_t n)
+{
+	while (n > 0) {
+		size_t len;
+		const char *src = iov_pos_ptr(pos, &len);
+
+		if (len > n)
+			len = n;
+		if (dst) {
+			memcpy(dst, src, len);
+			dst += len;
+		}
+		pos->offset += len;
+		n -= len;
+	}
+}
+
+/* Returns the number of blocks, out of the blk_count blocks at pos, that do
+not lie whole in one buffer */
+size_t iov_pos_split_blocks(iov_pos_t pos, size_t blk_count)
+{
+	size_t split = 0;
+
+	while (blk_count-- > 0) {
+		size_t len;
+
+		iov_pos_ptr(&pos, &len);
+		if (len < BLOCK_SIZE)
+			split++;
+		iov_pos_get(&pos, NULL, BLOCK_SIZE);
+	}
+
+	return split;
+}
+
+/* Split blk_count blocks along the FAT chain from fat_index into runs of
+consecutive disk blocks mapped onto the buffers at pos, and move pos past them.
+Blocks that do not lie whole in one buffer are mapped onto the next block of
+bounce instead, gathered from the buffers if gather is set. Returns the number
+of runs, and the block following the last one in next_index */
+size_t data_chain_runs(uint16_t fat_index, size_t blk_count, iov_pos_t *pos,
+		       char *bounce, int gather, struct block_aio *runs,
+		       uint16_t *next_index)
+{
+	size_t nruns = 0;
+
+	while (blk_count > 0) {
+		struct block_aio *run = nruns ? &runs[nruns - 1] : NULL;
+		size_t block = fat_index + superblock->data_blk;
+		size_t len;
+		char *buf = iov_pos_ptr(pos, &len);
+
+		if (len >= BLOCK_SIZE) {
+			pos->offset += BLOCK_SIZE;
+		} else {
+			iov_pos_get(pos, gather ? bounce : NULL, BLOCK_SIZE);
+			buf = bounce;
+			bounce += BLOCK_SIZE;
+		}
+
+		/* Extend the last run if both the block and its buffer follow it */
+		if (run && run->block + run->count == block &&
+		    (char*)run->buf + run->count * BLOCK_SIZE == buf) {
+			run->count++;
+		} else {
+			memset(&runs[nruns], 0, sizeof(struct block_aio));
+			runs[nruns].block = block;
+			runs[nruns].count = 1;
+			runs[nruns].buf = buf;
+			nruns++;
+		}
+
+		blk_count--;
+		fat_index = fat[fat_index];
+	}
+
+	*next_index = fat_index;
+	return nruns;
+}
+
+/* Transfer blk_count blocks along the FAT chain from fat_index from or to the
+buffers at pos, all runs of consecutive blocks submitted at once. Blocks go
+straight to or from the buffers, unless they do not lie whole in one of them.
+Moves fat_index to the block following the last one, and pos past them */
+int data_chain_io(uint16_t *fat_index, size_t blk_count, iov_pos_t *pos,
+		  int write)
+{
+	iov_pos_t start = *pos;
+	size_t split = iov_pos_split_blocks(*pos, blk_count);
+	struct block_aio *runs;
+	char *bounce = NULL;
+	char *b;
+	size_t nruns;
+	int ret = -1;
+
+	runs = (struct block_aio*) malloc(sizeof(struct block_aio) * blk_count);
+	if (runs == NULL)
+		return -1;
+	if (split && (bounce = (char*) block_buf_alloc(split)) == NULL)
+		goto out;
+
+	nruns = data_chain_runs(*fat_index, blk_count, pos, bounce, write, runs,
+				fat_index);
+	if (write)
+		ret = cache_write_runs(runs, nruns);
+	else
+		ret = cache_read_runs(runs, nruns);
+
+	/* Scatter the blocks read through bounce */
+	b = bounce;
+	while (!write && ret == 0 && b < bounce + split * BLOCK_SIZE) {
+		size_t len;
+
+		iov_pos_ptr(&start, &len);
+		if (len >= BLOCK_SIZE) {
+			start.offset += BLOCK_SIZE;
+			continue;
+		}
+		iov_pos_put(&start, b, BLOCK_SIZE);
+		b += BLOCK_SIZE;
+	}
+
+out:
+	block_buf_free(bounce, split);
+	free(runs);
+	return ret;
+}
+
+/* Read blk_count blocks along the FAT chain from fat_index into buf. Moves
+fat_index to the block following the last one read */
+int data_chain_read(uint16_t *fat_index, size_t blk_count, char *buf)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = blk_count * BLOCK_SIZE };
+	iov_pos_t pos = { .iov = &iov };
+
+	return data_chain_io(fat_index, blk_count, &pos, 0);
+}
+
+/* Write blk_count blocks from buf along the FAT chain from fat_index. Moves
+fat_index to the block following the last one written */
+int data_chain_write(uint16_t *fat_index, size_t blk_count, char *buf)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = blk_count * BLOCK_SIZE };
+	iov_pos_t pos = { .iov = &iov };
+
+	return data_chain_io(fat_index, blk_count, &pos, 1);
+}
+
+/* Copy byte_count bytes, starting byte_offset bytes into block fat_index, from
+a mapped disk to the buffers at pos. Each run of consecutive blocks is copied
+at once */
+void data_chain_copy(uint16_t fat_index, size_t byte_offset, size_t byte_count,
+		     iov_pos_t *pos)
+{
+	while (byte_count > 0) {
+		size_t blk_count = (byte_offset + byte_count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		size_t run = fat_run_length(fat_index, blk_count);
+		size_t run_bytes = run * BLOCK_SIZE - byte_offset;
+		const char *src = block_map(fat_index + superblock->data_blk);
+
+		if (run_bytes > byte_count)
+			run_bytes = byte_count;
+		iov_pos_put(pos, src + byte_offset, run_bytes);
+
+		byte_count -= run_bytes;
+		byte_offset = 0;
+		fat_index = fat[fat_index + run - 1];
+	}
+}
+
+/* Read byte_count bytes, starting byte_offset bytes into block fat_index, to
+the buffers at pos. Whole blocks are read straight into the buffers, only
+partial first and last blocks go through the one block scratch. Sets last to
+the content of the last block read and moves fat_index to the block following
+it */
+int data_chain_read_bytes(uint16_t *fat_index, size_t byte_offset,
+			  size_t byte_count, iov_pos_t *pos, char *scratch,
+			  const char **last)
+{
+	size_t blk_count;
+
+	/* Partial first block */
+	if (byte_offset != 0 || byte_count < BLOCK_SIZE) {
+		size_t n = BLOCK_SIZE - byte_offset;
+
+		if (n > byte_count)
+			n = byte_count;
+		if (data_block_read(*fat_index, scratch) == -1)
+			return -1;
+		iov_pos_put(pos, scratch + byte_offset, n);
+		*last = scratch;
+		*fat_index = fat[*fat_index];
+		byte_count -= n;
+	}
+
+	/* Whole blocks, no copy */
+	blk_count = byte_count / BLOCK_SIZE;
+	if (blk_count) {
+		iov_pos_t at = *pos;
+		size_t len;
+
+		if (data_chain_io(fat_index, blk_count, pos, 0) == -1)
+			return -1;
+		byte_count -= blk_count * BLOCK_SIZE;
+
+		/* The last block is found back in the buffers, unless a partial
+		one follows it */
+		if (byte_count == 0) {
+			iov_pos_get(&at, NULL, (blk_count - 1) * BLOCK_SIZE);
+			*last = iov_pos_ptr(&at, &len);
+			if (len < BLOCK_SIZE) {
+				iov_pos_get(&at, scratch, BLOCK_SIZE);
+				*last = scratch;
+			}
+		}
+	}
+
+	/* Partial last block */
+	if (byte_count) {
+		if (data_block_read(*fat_index, scratch) == -1)
+			return -1;
+		iov_pos_put(pos, scratch, byte_count);
+		*last = scratch;
+		*fat_index = fat[*fat_index];
+	}
+
+	return 0;
+}
+
+/* Map a block index through the swap of data blocks a and b */
+uint16_t defrag_swapped(uint16_t index, uint16_t a, uint16_t b)
+{
+	if (index == a)
+		return b;
+	if (index == b)
+		return a;
+	return index;
+}
+
+/* Set prev[i] to the predecessor of every data block */
+void defrag_build_prev(int32_t *prev)
+{
+	for (int i = 0; i < superblock->data_blk_count; i++)
+		prev[i] = DEFRAG_NO_PREV;
+
+	for (size_t i = 0; i <= rdir_count; i++) {
+		uint16_t fat_index;
+
+		/* Root directory blocks are chained like a file */
+		if (i == rdir_count) {
+			if (superblock->rdir_ext_count == 0)
+				continue;
+			fat_index = superblock->rdir_ext_index;
+			prev[fat_index] = DEFRAG_RDIR_HEAD;
+		} else {
+			fat_index = rdir_entry(i)->start_index;
+			/* Directories are left in place */
+			if (rdir_entry(i)->name[0] == '\0' || fat_index == FAT_EOC ||
+			    rdir_entry(i)->type == FILE_TYPE_DIR)
+				continue;
+			prev[fat_index] = DEFRAG_HEAD(i);
+		}
+
+		while (fat[fat_index] != FAT_EOC) {
+			prev[fat[fat_index]] = fat_index;
+			fat_index = fat[fat_index];
+		}
+	}
+}
+
+/* Point predecessor prev, as found by defrag_build_prev(), to block index */
+void defrag_relink(int32_t prev, uint16_t index)
+{
+	if (prev == DEFRAG_NO_PREV)
+		return;
+
+	if (prev == DEFRAG_RDIR_HEAD) {
+		superblock->rdir_ext_index = index;
+		superblock_dirty = 1;
+	} else if (prev < 0) {
+		rdir_entry(DEFRAG_HEAD(prev))->start_index = index;
+		rdir_mark_dirty(DEFRAG_HEAD(prev));
+	} else {
+		fat_set(prev, index);
+	}
+}
+
+/* Swap data blocks a and b, with their content, their place in FAT chains
+and what points to them. Either one can be free */
+int defrag_swap(uint16_t a, uint16_t b, int32_t *prev, char *blk_buf)
+{
+	uint16_t fat_a = fat[a];
+	uint16_t fat_b = fat[b];
+	int32_t prev_a = prev[a];
+	int32_t prev_b = prev[b];
+
+	/* Exchange contents, free blocks have none worth keeping */
+	if (fat_a != 0 && data_block_read(a, blk_buf) == -1)
+		return -1;
+	if (fat_b != 0 && data_block_read(b, blk_buf + BLOCK_SIZE) == -1)
+		return -1;
+	if (fat_a != 0 && data_block_write(b, blk_buf) == -1)
+		return -1;
+	if (fat_b != 0 && data_block_write(a, blk_buf + BLOCK_SIZE) == -1)
+		return -1;
+
+	/* Each block takes the other's successor */
+	fat_set(a, defrag_swapped(fat_b, a, b));
+	fat_set(b, defrag_swapped(fat_a, a, b));
+
+	/* Point predecessors to the new locations, unless that was just done */
+	if (prev_a != b)
+		defrag_relink(prev_a, b);
+	if (prev_b != a)
+		defrag_relink(prev_b, a);
+
+	prev[a] = (prev_b >= 0 && prev_b != DEFRAG_NO_PREV) ?
+		defrag_swapped(prev_b, a, b) : prev_b;
+	prev[b] = (prev_a >= 0 && prev_a != DEFRAG_NO_PREV) ?
+		defrag_swapped(prev_a, a, b) : prev_a;
+	if (fat[a] != 0 && fat[a] != FAT_EOC)
+		prev[fat[a]] = a;
+	if (fat[b] != 0 && fat[b] != FAT_EOC)
+		prev[fat[b]] = b;
+
+	return 0;
+}
+
+/* Find the disk blocks of the root directory blocks chained through the FAT.
+Returns -1 if the chain is broken */
+int rdir_ext_locate(void)
+{
+	uint16_t fat_index = superblock->rdir_ext_index;
+
+	for (size_t i = 1; i < rdir_blk_count; i++) {
+		if (fat_index == 0 || fat_index >= superblock->data_blk_count)
+			return -1;
+		/* Moved blocks must be written where they now are */
+		if (rdir_blk_index[i] != superblock->data_blk + fat_index) {
+			rdir_blk_index[i] = superblock->data_blk + fat_index;
+			rdir_dirty[i] = 1;
+		}
+		fat_index = fat[fat_index];
+	}
+
+	return 0;
+}
+
+/* Make room for blk_count root directory blocks */
+int rdir_reserve(size_t blk_count)
+{
+	size_t count = blk_count * RDIR_BLOCK_ENTRIES;
+	void *p;
+
+	if ((p = realloc(rdir_blocks, sizeof(file_t) * blk_count)) == NULL)
+		return -1;
+	rdir_blocks = p;
+	if ((p = realloc(rdir_blk_index, sizeof(uint16_t) * blk_count)) == NULL)
+		return -1;
+	rdir_blk_index = p;
+	if ((p = realloc(rdir_dirty, sizeof(uint8_t) * blk_count)) == NULL)
+		return -1;
+	rdir_dirty = p;
+	if ((p = realloc(rdir_hnext, sizeof(int32_t) * count)) == NULL)
+		return -1;
+	rdir_hnext = p;
+	if ((p = realloc(rdir_free_map, sizeof(uint64_t) * (count / 64))) == NULL)
+		return -1;
+	rdir_free_map = p;
+	if ((p = realloc(rdir_open_count, sizeof(uint8_t) * count)) == NULL)
+		return -1;
+	rdir_open_count = p;
+
+	/* New entries are free and closed */
+	for (size_t i = rdir_blk_count; i < blk_count; i++) {
+		rdir_blocks[i] = NULL;
+		rdir_dirty[i] = 0;
+		memset(rdir_free_map + i * RDIR_FREE_MAP_WORDS, 0,
+		       sizeof(uint64_t) * RDIR_FREE_MAP_WORDS);
+		memset(rdir_open_count + i * RDIR_BLOCK_ENTRIES, 0,
+		       RDIR_BLOCK_ENTRIES);
+	}
+
+	return 0;
+}
+
+/* Add a block of free entries to the root directory, chained through the FAT
+after the last one. Returns -1 if the root directory cannot grow */
+int rdir_grow(void)
+{
+	file_t blk;
+	int fat_index;
+
+	if (rdir_blk_count == FS_FILE_MAX_COUNT / RDIR_BLOCK_ENTRIES)
+		return -1;
+
+	fat_index = fat_find_free(0);
+	if (fat_index == FAT_EOC)
+		return -1;
+
+	blk = (file_t) calloc(1, BLOCK_SIZE);
+	if (blk == NULL || rdir_reserve(rdir_blk_count + 1) == -1) {
+		free(blk);
+		return -1;
+	}
+
+	/* Chain the block */
+	fat_set(fat_index, FAT_EOC);
+	if (superblock->rdir_ext_count == 0)
+		superblock->rdir_ext_index = fat_index;
+	else
+		fat_set(rdir_blk_index[rdir_blk_count - 1] - superblock->data_blk,
+			fat_index);
+	superblock->rdir_ext_count++;
+	superblock_dirty = 1;
+
+	rdir_blocks[rdir_blk_count] = blk;
+	rdir_blk_index[rdir_blk_count] = superblock->data_blk + fat_index;
+	rdir_dirty[rdir_blk_count] = 1;
+	memset(rdir_free_map + rdir_blk_count * RDIR_FREE_MAP_WORDS, 0xFF,
+	       sizeof(uint64_t) * RDIR_FREE_MAP_WORDS);
+	rdir_blk_count++;
+	rdir_count += RDIR_BLOCK_ENTRIES;
+	free_file_count += RDIR_BLOCK_ENTRIES;
+
+	/* Keep lookups short */
+	if (rdir_index_buckets(rdir_count) > rdir_nbuckets)
+		rdir_index_rehash(rdir_index_buckets(rdir_count));
+
+	return 0;
+}
+
+/* Free the FAT chain from fat_index */
+void fat_free_chain(uint16_t fat_index)
+{
+	stat_add(fat_walks, 1);
+	while (fat_index != FAT_EOC) {
+		uint16_t next_index = fat[fat_index];
+
+		stat_add(fat_walk_entries, 1);
+		fat_set(fat_index, 0);
+		fat_index = next_index;
+	}
+}
+
+/* Free the blk_count blocks chained after block last, which is then followed
+by the block that came after them */
+void fat_unchain(uint16_t last, size_t blk_count)
+{
+	uint16_t fat_index = fat[last];
+
+	while (blk_count-- > 0) {
+		uint16_t next_index = fat[fat_index];
+
+		fat_set(fat_index, 0);
+		fat_index = next_index;
+	}
+	fat_set(last, fat_index);
+}
+
+/* Fill data block fat_index with zeros */
+int data_block_zero(uint16_t fat_index)
+{
+	char *blk_buf = (char*) block_buf_alloc(1);
+	int ret;
+
+	if (blk_buf == NULL)
+		return -1;
+
+	memset(blk_buf, 0, BLOCK_SIZE);
+	ret = data_block_write(fat_index, blk_buf);
+	block_buf_free(blk_buf, 1);
+
+	return ret;
+}
+
+/* Write hole map holes of the file open_file is open on, and give it to every
+file descriptor of the file, with its blocks mapped again. A map without holes
+is freed, and the file is no longer sparse. Metadata lock held exclusively */
+int hole_map_write(const open_file_t *open_file, const hole_map_t *holes)
+{
+	file_t file = open_file->file;
+	uint16_t map = file->start_index;
+	int ret = 0;
+
+	if (holes->count == 0) {
+		file->start_index = fat[map];
+		file->flags &= ~FILE_SPARSE;
+		file_mark_dirty(open_file);
+		fat_set(map, 0);
+	} else {
+		ret = data_block_write(map, (void*)holes);
+	}
+
+	/* Keep the descriptors in line with the chain, even if the map could not
+	be written */
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (open_files[i].file != file)
+			continue;
+		if (holes->count) {
+			hole_maps[i] = *holes;
+			open_files[i].holes = &hole_maps[i];
+		} else {
+			open_files[i].holes = NULL;
+		}
+		extent_drop(&open_files[i]);
+		extent_build(&open_files[i]);
+	}
+
+	return ret;
+}
+
+/* Take blk_count blocks of open_file from file_blk on out of the hole holding
+them, which is split in two if they are in its middle */
+int hole_carve(const open_file_t *open_file, size_t file_blk, size_t blk_count)
+{
+	hole_run_t *run;
+	size_t run_end;
+	size_t i;
+
+	hole_scratch = *open_file->holes;
+	for (i = 0; hole_scratch.runs[i].file_blk +
+		    hole_scratch.runs[i].count <= file_blk; i++)
+		;
+	run = &hole_scratch.runs[i];
+	run_end = run->file_blk + run->count;
+
+	if (file_blk > run->file_blk && file_blk + blk_count < run_end) {
+		memmove(run + 2, run + 1,
+			sizeof(hole_run_t) * (hole_scratch.count - i - 1));
+		run[1].file_blk = file_blk + blk_count;
+		run[1].count = run_end - (file_blk + blk_count);
+		run->count = file_blk - run->file_blk;
+		hole_scratch.count++;
+	} else if (file_blk > run->file_blk) {
+		run->count = file_blk - run->file_blk;
+	} else if (file_blk + blk_count < run_end) {
+		run->file_blk = file_blk + blk_count;
+		run->count = run_end - (file_blk + blk_count);
+	} else {
+		memmove(run, run + 1,
+			sizeof(hole_run_t) * (hole_scratch.count - i - 1));
+		hole_scratch.count--;
+	}
+
+	return hole_map_write(open_file, &hole_scratch);
+}
+
+/* Record blk_count blocks of open_file from file_blk on as a hole, chaining a
+hole map in front of its blocks first if it is not sparse yet. Returns -1 if
+the hole map is full, there is no block left for it or it cannot be written,
+with the file left as it was */
+int hole_insert(const open_file_t *open_file, size_t file_blk, size_t blk_count)
+{
+	file_t file = open_file->file;
+	size_t i;
+
+	if (open_file->holes) {
+		if (open_file->holes->count == HOLE_MAP_RUNS)
+			return -1;
+		hole_scratch = *open_file->holes;
+	} else {
+		int map = fat_find_free(0);
+
+		if (map == FAT_EOC)
+			return -1;
+		fat_set(map, file->start_index);
+		file->start_index = map;
+		file->flags |= FILE_SPARSE;
+		file_mark_dirty(open_file);
+		memset(&hole_scratch, 0, sizeof(hole_map_t));
+	}
+
+	/* Keep the holes sorted */
+	for (i = 0; i < hole_scratch.count; i++) {
+		if (hole_scratch.runs[i].file_blk > file_blk)
+			break;
+	}
+	memmove(&hole_scratch.runs[i + 1], &hole_scratch.runs[i],
+		sizeof(hole_run_t) * (hole_scratch.count - i));
+	hole_scratch.runs[i].file_blk = file_blk;
+	hole_scratch.runs[i].count = blk_count;
+	hole_scratch.count++;
+
+	if (hole_map_write(open_file, &hole_scratch) == -1) {
+		hole_carve(open_file, file_blk, blk_count);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Give data blocks to the blk_count blocks of open_file from file_blk on, all
+in a same hole. If the hole map has no room to split the hole, the blocks up to
+its end get zeroed data blocks as well. Returns the number of blocks from
+file_blk given data blocks, or -1 if the blocks cannot be zeroed or the hole
+map written, with the new blocks given back */
+ssize_t hole_fill(const open_file_t *open_file, size_t file_blk,
+		  size_t blk_count)
+{
+	const hole_map_t *holes = open_file->holes;
+	const hole_run_t *run = holes->runs;
+	hole_map_t old_holes;
+	size_t fill = blk_count;
+	size_t run_start;
+	size_t run_end;
+	uint16_t last;
+	uint16_t fat_index;
+	size_t added;
+
+	while (run->file_blk + run->count <= file_blk)
+		run++;
+	run_start = run->file_blk;
+	run_end = run->file_blk + run->count;
+
+	if (file_blk > run_start && file_blk + fill < run_end &&
+	    holes->count == HOLE_MAP_RUNS)
+		fill = run_end - file_blk;
+
+	/* A hole always has a block after it, the new blocks go before it */
+	last = file_last_block(open_file, run_start);
+	added = file_chain(open_file, last, file_blk, fill);
+	if (added == 0)
+		return 0;
+
+	/* A full hole map cannot split the hole either if the disk ran out of
+	blocks before its end */
+	if (file_blk > run_start && file_blk + added < run_end &&
+	    holes->count == HOLE_MAP_RUNS) {
+		fat_unchain(last, added);
+		return 0;
+	}
+
+	/* Zero the blocks the caller does not write, before they are mapped */
+	fat_index = last;
+	for (size_t i = 0; i < added; i++) {
+		fat_index = fat[fat_index];
+		if (i >= blk_count && data_block_zero(fat_index) == -1) {
+			fat_unchain(last, added);
+			return -1;
+		}
+	}
+
+	old_holes = *holes;
+	if (hole_carve(open_file, file_blk, added) == -1) {
+		fat_unchain(last, added);
+		hole_map_write(open_file, &old_holes);
+		return -1;
+	}
+
+	return (added < blk_count) ? added : blk_count;
+}
+
+/* Give data blocks to the blocks of open_file from file_blk on, blk_count of
+them, that have none. Holes are filled, and the chain extended past a new hole
+if file_blk is beyond its end. Returns the number of blocks from file_blk with
+a data block, fewer than blk_count if the disk is full or the hole map cannot
+be written, or -1 if that failure leaves none. Metadata lock held
+exclusively */
+ssize_t open_map(const open_file_t *open_file, size_t file_blk,
+		 size_t blk_count)
+{
+	size_t alloc_count = file_alloc_count(open_file);
+	size_t end = file_blk + blk_count;
+	size_t blk = file_blk;
+	size_t from;
+	size_t added;
+
+	/* Fill the holes */
+	while (blk < end && blk < alloc_count) {
+		int hole;
+		size_t span = open_span(open_file, blk, &hole);
+
+		if (span > end - blk)
+			span = end - blk;
+		if (hole) {
+			ssize_t filled = hole_fill(open_file, blk, span);
+
+			if (filled == -1)
+				return (blk > file_blk) ? blk - file_blk : -1;
+			if ((size_t)filled < span)
+				return blk + filled - file_blk;
+		}
+		blk += span;
+	}
+	if (end <= alloc_count)
+		return blk_count;
+
+	/* Leave a hole up to file_blk. If the hole map is full or cannot be
+	written, the blocks in between are chained as well */
+	from = (file_blk > alloc_count) ? file_blk : alloc_count;
+	if (from > alloc_count &&
+	    hole_insert(open_file, alloc_count, from - alloc_count) == -1)
+		from = alloc_count;
+
+	added = file_chain(open_file, file_last_block(open_file, alloc_count),
+			   from, end - from);
+
+	/* Holes need a block after them. None of the blocks is mapped then, as
+	from is file_blk */
+	if (added == 0 && from > alloc_count)
+		return hole_carve(open_file, alloc_count, from - alloc_count);
+
+	if (from + added < end)
+		return (from + added > file_blk) ? from + added - file_blk : 0;
+
+	return blk_count;
+}
+
+/* Returns the number of blocks of directory dir */
+size_t dir_blk_count(uint16_t dir)
+{
+	size_t count = 0;
+
+	stat_add(fat_walks, 1);
+	while (dir != FAT_EOC) {
+		stat_add(fat_walk_entries, 1);
+		dir = fat[dir];
+		count++;
+	}
+
+	return count;
+}
+
+/* Returns the block of directory dir holding the names of hash. Directories
+have a power of two number of blocks */
+uint16_t dir_block(uint16_t dir, uint32_t hash)
+{
+	size_t blk = hash & (dir_blk_count(dir) - 1);
+
+	stat_add(fat_walks, 1);
+	stat_add(fat_walk_entries, blk);
+	while (blk-- > 0)
+		dir = fat[dir];
+
+	return dir;
+}
+
+/* Returns the slot holding filename in a directory block, or -1 with the free
+slot it would take in free_slot (-1 as well if the block is full) */
+int dir_block_find(file_t entries, const char *filename, uint32_t hash,
+		   int *free_slot)
+{
+	int slot = (hash >> 16) % DIR_SLOTS;
+
+	stat_add(dir_scans, 1);
+	for (int i = 0; i < DIR_SLOTS; i++) {
+		stat_add(dir_scan_entries, 1);
+		if (entries[slot].name[0] == '\0') {
+			if (free_slot)
+				*free_slot = slot;
+			return -1;
+		}
+		if (strcmp((char*)entries[slot].name, filename) == 0)
+			return slot;
+		slot = (slot + 1) % DIR_SLOTS;
+	}
+
+	if (free_slot)
+		*free_slot = -1;
+	return -1;
+}
+
+/* Place entry in the block of entries starting at the slot of its hash.
+Returns -1 if the block is full */
+int dir_block_place(file_t entries, const struct file *entry)
+{
+	int slot = (name_hash((char*)entry->name) >> 16) % DIR_SLOTS;
+
+	for (int i = 0; i < DIR_SLOTS; i++) {
+		if (entries[slot].name[0] == '\0') {
+			entries[slot] = *entry;
+			return 0;
+		}
+		slot = (slot + 1) % DIR_SLOTS;
+	}
+
+	return -1;
+}
+
+/* Double the number of blocks of directory dir, and spread its entries over
+them. Returns -1 if there is not enough free space or if writing the
+directory fails, which then keeps its blocks and entries */
+int dir_grow(uint16_t dir)
+{
+	size_t count = dir_blk_count(dir);
+	size_t new_count = count;
+	file_t old_entries;
+	file_t new_entries = NULL;
+	uint16_t first = FAT_EOC;
+	uint16_t last = dir;
+	uint16_t next;
+	int ret = -1;
+
+	old_entries = (file_t) block_buf_alloc(count);
+	if (old_entries == NULL)
+		return -1;
+	if (data_chain_read(&last, count, (char*)old_entries) == -1)
+		goto out;
+
+	/* Names can collide in a block even once it doubled, so keep doubling
+	until every entry fits */
+	while (1) {
+		size_t i;
+
+		new_count *= 2;
+		if (new_count - count > free_blk_count)
+			goto out;
+
+		free(new_entries);
+		new_entries = (file_t) calloc(new_count, BLOCK_SIZE);
+		if (new_entries == NULL)
+			goto out;
+
+		for (i = 0; i < count * DIR_SLOTS; i++) {
+			file_t entry = &old_entries[i];
+			size_t blk;
+
+			if (entry->name[0] == '\0')
+				continue;
+			blk = name_hash((char*)entry->name) & (new_count - 1);
+			if (dir_block_place(new_entries + blk * DIR_SLOTS, entry) == -1)
+				break;
+		}
+		if (i == count * DIR_SLOTS)
+			break;
+	}
+
+	/* Write the new blocks out as a chain of their own */
+	for (size_t i = count; i < new_count; i++) {
+		uint16_t fat_index = fat_find_free(0);
+
+		if (fat_index == FAT_EOC) {
+			fat_free_chain(first);
+			goto out;
+		}
+		fat_set(fat_index, FAT_EOC);
+		if (first == FAT_EOC)
+			first = fat_index;
+		else
+			fat_set(last, fat_index);
+		last = fat_index;
+	}
+	next = first;
+	if (data_chain_write(&next, new_count - count,
+			     (char*)(new_entries + count * DIR_SLOTS)) == -1) {
+		fat_free_chain(first);
+		goto out;
+	}
+
+	/* Then the old blocks, put back as they were if that fails */
+	next = dir;
+	if (data_chain_write(&next, count, (char*)new_entries) == -1) {
+		fat_free_chain(first);
+		next = dir;
+		data_chain_write(&next, count, (char*)old_entries);
+		goto out;
+	}
+
+	/* Only now link the new blocks to the directory */
+	last = dir;
+	while (fat[last] != FAT_EOC)
+		last = fat[last];
+	fat_set(last, first);
+	ret = 0;
+
+out:
+	free(new_entries);
+	block_buf_free(old_entries, count);
+	return ret;
+}
+
+/* Look filename up in directory dir, and copy its entry to entry if it is not
+NULL. Returns -1 if there is no such file */
+int dir_find(uint16_t dir, const char *filename, struct file *entry)
+{
+	uint32_t hash = name_hash(filename);
+	file_t entries = (file_t) block_buf_alloc(1);
+	int slot = -1;
+
+	if (entries == NULL)
+		return -1;
+
+	/* Only the block of the hash is read */
+	if (data_block_read(dir_block(dir, hash), entries) == 0)
+		slot = dir_block_find(entries, filename, hash, NULL);
+	if (slot != -1 && entry)
+		*entry = entries[slot];
+
+	block_buf_free(entries, 1);
+	return (slot == -1) ? -1 : 0;
+}
+
+/* Add entry to directory dir, growing the directory if the block of its hash
+is full. Returns -1 if a file of the same name exists or on failure */
+int dir_insert(uint16_t dir, const struct file *entry)
+{
+	uint32_t hash = name_hash((char*)entry->name);
+	file_t entries = (file_t) block_buf_alloc(1);
+	int ret = -1;
+
+	if (entries == NULL)
+		return -1;
+
+	while (1) {
+		uint16_t blk = dir_block(dir, hash);
+		int free_slot;
+
+		if (data_block_read(blk, entries) == -1)
+			break;
+		if (dir_block_find(entries, (char*)entry->name, hash,
+				   &free_slot) != -1)
+			break;
+		if (free_slot != -1) {
+			entries[free_slot] = *entry;
+			ret = data_block_write(blk, entries);
+			break;
+		}
+		if (dir_grow(dir) == -1)
+			break;
+	}
+
+	block_buf_free(entries, 1);
+	return ret;
+}
+
+/* Replace the entry of the same name as entry in directory dir */
+int dir_update(uint16_t dir, const struct file *entry)
+{
+	uint32_t hash = name_hash((char*)entry->name);
+	uint16_t blk = dir_block(dir, hash);
+	file_t entries = (file_t) block_buf_alloc(1);
+	int ret = -1;
+	int slot;
+
+	if (entries == NULL)
+		return -1;
+
+	if (data_block_read(blk, entries) == 0 &&
+	    (slot = dir_block_find(entries, (char*)entry->name, hash, NULL)) != -1) {
+		entries[slot] = *entry;
+		ret = data_block_write(blk, entries);
+	}
+
+	block_buf_free(entries, 1);
+	return ret;
+}
+
+/* Remove filename from directory dir */
+int dir_remove(uint16_t dir, const char *filename)
+{
+	uint32_t hash = name_hash(filename);
+	uint16_t blk = dir_block(dir, hash);
+	file_t entries = (file_t) block_buf_alloc(1);
+	int ret = -1;
+	int hole;
+
+	if (entries == NULL)
+		return -1;
+
+	if (data_block_read(blk, entries) == -1 ||
+	    (hole = dir_block_find(entries, filename, hash, NULL)) == -1)
+		goto out;
+
+	/* Shift back the following entries that would no longer be found past
+	the hole, so that lookups can keep stopping at the first free slot */
+	for (int i = 1, slot = hole; i < DIR_SLOTS; i++) {
+		int home;
+
+		slot = (slot + 1) % DIR_SLOTS;
+		if (entries[slot].name[0] == '\0')
+			break;
+
+		home = (name_hash((char*)entries[slot].name) >> 16) % DIR_SLOTS;
+		if ((slot > hole && (home <= hole || home > slot)) ||
+		    (slot < hole && home <= hole && home > slot)) {
+			entries[hole] = entries[slot];
+			hole = slot;
+		}
+	}
+	memset(&entries[hole], 0, sizeof(struct file));
+	ret = data_block_write(blk, entries);
+
+out:
+	block_buf_free(entries, 1);
+	return ret;
+}
+
+/* Returns 1 if directory dir holds no file, 0 if it does and -1 on failure */
+int dir_is_empty(uint16_t dir)
+{
+	size_t count = dir_blk_count(dir);
+	file_t entries = (file_t) block_buf_alloc(count);
+	int ret = 1;
+
+	if (entries == NULL)
+		return -1;
+
+	if (data_chain_read(&dir, count, (char*)entries) == -1)
+		ret = -1;
+	for (size_t i = 0; ret == 1 && i < count * DIR_SLOTS; i++) {
+		if (entries[i].name[0] != '\0') {
+			ret = 0;
+			break;
+		}
+	}
+
+	block_buf_free(entries, count);
+	return ret;
+}
+
+/* Look filename up in directory dir, root directory or not, and copy its
+entry to entry. Returns -1 if there is no such file */
+int dir_lookup(uint16_t dir, const char *filename, struct file *entry)
+{
+	int index;
+
+	if (dir != DIR_ROOT)
+		return dir_find(dir, filename, entry);
+
+	index = rdir_find_file(filename);
+	if (index == -1)
+		return -1;
+	*entry = *rdir_entry(index);
+
+	return 0;
+}
+
+/* Find the directory holding the file at path, and the file name. Returns -1
+if path is invalid or one of its directories does not exist */
+int path_resolve(const char *path, uint16_t *dir, char *filename)
+{
+	uint16_t cur = DIR_ROOT;
+
+	if (path == NULL || strnlen(path, FS_PATH_MAX_LEN) == FS_PATH_MAX_LEN)
+		return -1;
+
+	while (1) {
+		size_t len;
+		struct file entry;
+
+		while (*path == '/')
+			path++;
+		len = strcspn(path, "/");
+		if (len == 0 || len >= FS_FILENAME_LEN)
+			return -1;
+		memcpy(filename, path, len);
+		filename[len] = '\0';
+
+		path += len;
+		while (*path == '/')
+			path++;
+		if (*path == '\0')
+			break;
+
+		/* Go down one directory */
+		if (dir_lookup(cur, filename, &entry) == -1 ||
+		    entry.type != FILE_TYPE_DIR)
+			return -1;
+		cur = entry.start_index;
+	}
+
+	*dir = cur;
+	return 0;
+}
+
+/* Returns the node of the open file filename of directory dir, or -1 if it
+is not open */
+int node_find(uint16_t dir, const char *filename)
+{
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (open_nodes[i].refs && open_nodes[i].dir == dir &&
+		    strcmp((char*)open_nodes[i].entry.name, filename) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Write the entry of node back to its directory, if it was modified */
+int node_write(int node)
+{
+	if (!open_nodes[node].dirty)
+		return 0;
+
+	if (dir_update(open_nodes[node].dir, &open_nodes[node].entry) == -1)
+		return -1;
+	open_nodes[node].dirty = 0;
+
+	return 0;
+}
+
+/* Create a file of type at path, with one data block */
+int file_create(const char *path, uint8_t type)
+{
+	char filename[FS_FILENAME_LEN];
+	struct file entry;
+	int empty_index = -1;
+	int fat_index = 0;
+	uint16_t dir;
+
+	if (path_resolve(path, &dir, filename) == -1)
+		return -1;
+
+	/* Check if filename already exists */
+	if (dir_lookup(dir, filename, &entry) != -1)
+		return -1;
+
+	/* Find a free entry, growing the root directory if it is full, and
+	there is room left for the file as well */
+	if (dir == DIR_ROOT) {
+		empty_index = rdir_find_free();
+		if (empty_index == -1) {
+			if (free_blk_count < 2 || rdir_grow() == -1)
+				return -1;
+			empty_index = rdir_find_free();
+		}
+	}
+
+	/* Check for full disk */
+	fat_index = fat_find_free(0);
+	if (fat_index == FAT_EOC)
+		return -1;
+
+	/* Directories start with one block of free entries */
+	if (type == FILE_TYPE_DIR && data_block_zero(fat_index) == -1)
+		return -1;
+
+	/* Create a new file */
+	memset(&entry, 0, sizeof(struct file));
+	strcpy((char*)entry.name, filename);
+	entry.start_index = fat_index;
+	entry.type = type;
+	fat_set(fat_index, FAT_EOC);
+
+	if (dir != DIR_ROOT) {
+		if (dir_insert(dir, &entry) == -1) {
+			fat_set(fat_index, 0);
+			return -1;
+		}
+		return 0;
+	}
+
+	*rdir_entry(empty_index) = entry;
+	rdir_index_insert(empty_index);
+	free_file_count--;
+	rdir_mark_dirty(empty_index);
+
+	return 0;
+}
+
+/* Remove the file of type at path, and free its blocks. Open files and
+directories that are not empty cannot be removed */
+int file_remove(const char *path, uint8_t type)
+{
+	char filename[FS_FILENAME_LEN];
+	struct file entry;
+	int index = -1;
+	uint16_t dir;
+
+	if (path_resolve(path, &dir, filename) == -1)
+		return -1;
+
+	/* Check if file exists */
+	if (dir_lookup(dir, filename, &entry) == -1 || entry.type != type)
+		return -1;
+
+	/* Check if file is open */
+	if (dir == DIR_ROOT) {
+		index = rdir_find_file(filename);
+		if (rdir_open_count[index] != 0)
+			return -1;
+	} else if (node_find(dir, filename) != -1) {
+		return -1;
+	}
+
+	if (type == FILE_TYPE_DIR && dir_is_empty(entry.start_index) != 1)
+		return -1;
+
+	/* Delete the file */
+	if (dir != DIR_ROOT) {
+		if (dir_remove(dir, filename) == -1)
+			return -1;
+		fat_free_chain(entry.start_index);
+		return 0;
+	}
+
+	fat_free_chain(entry.start_index);
+	rdir_index_remove(index);
+	memset(rdir_entry(index),0,sizeof(struct file));
+	free_file_count++;
+	rdir_mark_dirty(index);
+
+	return 0;
+}
+
+/* Open a RAM disk and write an empty file system with data_blk_count data
+blocks on it */
+int disk_format_ram(size_t data_blk_count)
+{
+	superblock_t new_superblock;
+	uint16_t *fat_blk;
+	size_t fat_blk_count = (data_blk_count * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	size_t total_blk_count = 2 + fat_blk_count + data_blk_count;
+
+	/* Block indexes are 16 bits wide */
+	if (data_blk_count >= FAT_EOC || total_blk_count > UINT16_MAX)
+		return -1;
+
+	if (block_disk_open_backend(&block_ram_backend, NULL, 0, total_blk_count) == -1)
+		return -1;
+
+	/* The disk reads back as zeros, only non-zero blocks are written */
+	new_superblock = (superblock_t) calloc(1, BLOCK_SIZE);
+	fat_blk = (uint16_t*) calloc(1, BLOCK_SIZE);
+	if (new_superblock == NULL || fat_blk == NULL) {
+		free(new_superblock);
+		free(fat_blk);
+		block_disk_close();
+		return -1;
+	}
+	memcpy(new_superblock->signature, ECS150FS_SIG, ECS150FS_SIG_SIZE);
+	new_superblock->total_blk_count = total_blk_count;
+	new_superblock->root_blk = 1 + fat_blk_count;
+	new_superblock->data_blk = new_superblock->root_blk + 1;
+	new_superblock->data_blk_count = data_blk_count;
+	new_superblock->fat_blk_count = fat_blk_count;
+
+	/* First data block is never allocated */
+	fat_blk[0] = FAT_EOC;
+
+	if (block_write(0, new_superblock) == -1 ||
+	    block_write(1, fat_blk) == -1) {
+		free(new_superblock);
+		free(fat_blk);
+		block_disk_close();
+		return -1;
+	}
+	free(new_superblock);
+	free(fat_blk);
+
+	return 0;
+}
+
+/* Write the modified FAT blocks, root directory blocks and superblock to the
+cache */
+int metadata_write(void)
+{
+	int ret = 0;
+
+	/* Entries of open files go to their directory blocks first */
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (open_nodes[i].refs && node_write(i) == -1)
+			ret = -1;
+	}
+
+	for (int i = 0; i < superblock->fat_blk_count; i++) {
+		if (!fat_dirty[i])
+			continue;
+		if (cache_write(1 + i, fat + (i * FAT_PER_BLOCK)) == -1)
+			ret = -1;
+		else
+			fat_dirty[i] = 0;
+	}
+
+	for (size_t i = 0; i < rdir_blk_count; i++) {
+		if (!rdir_dirty[i])
+			continue;
+		if (cache_write(rdir_blk_index[i], rdir_blocks[i]) == -1)
+			ret = -1;
+		else
+			rdir_dirty[i] = 0;
+	}
+
+	if (superblock_dirty) {
+		if (cache_write(0, superblock) == -1)
+			ret = -1;
+		else
+			superblock_dirty = 0;
+	}
+
+	return ret;
+}
+
+/* Write byte_count bytes from the buffers at pos, byte_offset bytes into data
+block block, through the one block buffer blk_buf. The rest of the block is
+read first only if it holds file data */
+int data_block_patch(size_t block, size_t byte_offset, size_t byte_count,
+		     iov_pos_t *pos, int keep, char *blk_buf)
+{
+	if (keep) {
+		if (data_block_read(block, blk_buf) == -1)
+			return -1;
+	} else {
+		memset(blk_buf, 0, BLOCK_SIZE);
+	}
+	iov_pos_get(pos, blk_buf + byte_offset, byte_count);
+	return data_block_write(block, blk_buf);
+}
+
+/* Write zeros over the bytes of open_file from from to to, in its blocks that
+have data blocks: holes read back as zeros already */
+int open_zero(const open_file_t *open_file, size_t from, size_t to,
+	      char *blk_buf)
+{
+	while (from < to) {
+		size_t byte_offset = from % BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - byte_offset;
+		int hole;
+		size_t span = open_span(open_file, from / BLOCK_SIZE, &hole);
+
+		/* Skip holes */
+		if (hole) {
+			if (span > (to - 1) / BLOCK_SIZE - from / BLOCK_SIZE)
+				break;
+			from += span * BLOCK_SIZE - byte_offset;
+			continue;
+		}
+
+		if (n > to - from)
+			n = to - from;
+		if (byte_offset) {
+			if (data_block_read(fat_find_block(open_file,
+							   from / BLOCK_SIZE),
+					    blk_buf) == -1)
+				return -1;
+		} else {
+			memset(blk_buf, 0, BLOCK_SIZE);
+		}
+		memset(blk_buf + byte_offset, 0, n);
+		if (data_block_write(fat_find_block(open_file, from / BLOCK_SIZE),
+				     blk_buf) == -1)
+			return -1;
+		from += n;
+	}
+
+	return 0;
+}
+
+/* Write count bytes from the buffers of iov to write_file at offset. Whole
+blocks are written straight from the buffers. Writes to blocks that have
+data blocks within the file need the data lock of the file, and other writes
+the metadata lock held exclusively. Returns the number of bytes written before
+any I/O failure, or -1 if there are none */
+int open_write(open_file_t *write_file, const struct iovec *iov, size_t count,
+	       size_t offset)
+{
+	iov_pos_t pos = { .iov = iov };
+	char *blk_buf;
+	size_t blk_count;
+	uint16_t blk_index;
+	size_t byte_count;
+	size_t byte_rem;
 	size_t byte_offset;
-	open_file_t read_file;
+	size_t old_size;
+	size_t zero_end;
+	int keep_first;
+	int keep_last;
+
+	/* Files hold at most FILE_SIZE_MAX bytes */
+	if (offset >= FILE_SIZE_MAX)
+		return 0;
+	if (count > FILE_SIZE_MAX - offset)
+		count = FILE_SIZE_MAX - offset;
+
+	/* Setup blk writing variables */
+	byte_count = count;
+	old_size = write_file->file->size;
+	if (byte_count == 0)
+		return 0;
+
+	/* Prefetched blocks are about to be stale */
+	open_drop_readahead(write_file->file);
+
+	/* Setup variables */
+	byte_offset = offset % BLOCK_SIZE;
+	blk_count = (byte_offset + byte_count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	/* Partially written blocks keep the data they have */
+	keep_first = offset - byte_offset < old_size;
+	keep_last = offset + byte_count - (byte_offset + byte_count) % BLOCK_SIZE <
+		    old_size;
+
+	/* Give data blocks to the blocks without, as many as the disk has room
+	for */
+	if (!open_mapped(write_file, offset, byte_count)) {
+		ssize_t mapped;
+
+		keep_first = keep_first &&
+			fat_find_block(write_file, offset / BLOCK_SIZE) != FAT_EOC;
+		keep_last = keep_last &&
+			fat_find_block(write_file, offset / BLOCK_SIZE +
+				       blk_count - 1) != FAT_EOC;
+		mapped = open_map(write_file, offset / BLOCK_SIZE, blk_count);
+		if (mapped == -1)
+			return -1;
+
+		/* No space left on disk, the write then ends on a block */
+		if ((size_t)mapped < blk_count) {
+			if (mapped == 0)
+				return 0;
+			byte_count = mapped * BLOCK_SIZE - byte_offset;
+		}
+	}
+
+	blk_index = fat_find_block(write_file, offset / BLOCK_SIZE);
+	blk_buf = (char*) block_buf_alloc(1);
+	if (blk_buf == NULL)
+		return -1;
+	byte_rem = byte_count;
+
+	/* Bytes between the end of the file and offset read back as zeros. The
+	first block written is zeroed with it if it starts past the end */
+	if (offset > old_size) {
+		zero_end = offset - byte_offset;
+		if (zero_end < old_size)
+			zero_end = offset;
+		if (open_zero(write_file, old_size, zero_end, blk_buf) == -1)
+			goto out;
+	}
+
+	/* Modify first block at offset, unless it is overwritten whole */
+	if (byte_offset != 0 || byte_rem < BLOCK_SIZE) {
+		size_t n = BLOCK_SIZE - byte_offset;
+
+		if (n > byte_rem)
+			n = byte_rem;
+		if (data_block_patch(blk_index, byte_offset, n, &pos,
+				     keep_first, blk_buf) == -1)
+			goto out;
+		blk_index = fat[blk_index];
+		byte_rem -= n;
+	}
+
+	/* Full data blocks are written without being read */
+	blk_count = byte_rem / BLOCK_SIZE;
+	if (blk_count) {
+		if (data_chain_io(&blk_index, blk_count, &pos, 1) == -1)
+			goto out;
+		byte_rem -= blk_count * BLOCK_SIZE;
+	}
+
+	/* Modify start of last block */
+	if (byte_rem && data_block_patch(blk_index, 0, byte_rem, &pos,
+					 keep_last, blk_buf) == 0)
+		byte_rem = 0;
+
+out:
+	block_buf_free(blk_buf, 1);
+
+	/* Only the bytes written before a failure count */
+	byte_count -= byte_rem;
+	if (byte_count == 0)
+		return -1;
+
+	/* Grow the file */
+	if (offset + byte_count > old_size) {
+		write_file->file->size = offset + byte_count;
+		file_mark_dirty(write_file);
+	}
+
+	return byte_count;
+}
+
+/* Write the bytes gathered in the write buffer of open_file, metadata lock
+held exclusively. Bytes that could not be written stay in the buffer, for the
+next flush to try again */
+int open_flush(open_file_t *open_file)
+{
+	struct iovec iov = {
+		.iov_base = open_file->wb_buf,
+		.iov_len = open_file->wb_len,
+	};
+	int ret;
+
+	if (iov.iov_len == 0)
+		return 0;
+
+	ret = open_write(open_file, &iov, iov.iov_len, open_file->wb_offset);
+	if (ret == (int)iov.iov_len) {
+		__atomic_store_n(&open_file->wb_len, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	/* Keep the tail that was not written */
+	if (ret > 0) {
+		memmove(open_file->wb_buf, open_file->wb_buf + ret,
+			iov.iov_len - ret);
+		open_file->wb_offset += ret;
+		__atomic_store_n(&open_file->wb_len, iov.iov_len - ret,
+				 __ATOMIC_RELAXED);
+	}
+
+	return -1;
+}
+
+/* Write the bytes gathered by every file descriptor of file, metadata lock
+held exclusively */
+int open_flush_file(file_t file)
+{
+	int ret = 0;
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (open_files[i].file == file && open_flush(&open_files[i]) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Write the bytes gathered by every file descriptor, metadata lock held
+exclusively */
+int open_flush_all(void)
+{
+	int ret = 0;
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (open_files[i].file && open_flush(&open_files[i]) == -1)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Write out the writes buffered for the file open as fd, before it is
+accessed otherwise */
+int fd_flush(int fd)
+{
+	int pending;
+	int ret = 0;
+
+	pthread_rwlock_rdlock(&fs_lock);
+	pending = valid_fd(fd) && open_write_pending(open_files[fd].file, -1);
+	pthread_rwlock_unlock(&fs_lock);
+
+	if (!pending)
+		return 0;
+
+	/* Buffered writes can extend the file */
+	pthread_rwlock_wrlock(&fs_lock);
+	if (valid_fd(fd))
+		ret = open_flush_file(open_files[fd].file);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+/* Free the metadata of the mounted file system */
+void metadata_free(void)
+{
+	free(superblock);
+	for (size_t i = 0; i < rdir_blk_count; i++)
+		free(rdir_blocks[i]);
+	free(rdir_blocks);
+	free(rdir_blk_index);
+	free(rdir_dirty);
+	free(rdir_buckets);
+	free(rdir_hnext);
+	free(rdir_free_map);
+	free(rdir_open_count);
+	free(fat);
+	free(fat_dirty);
+	free(free_map);
+}
+
+/***** API Functions *****/
+int fs_mount(const char *diskname)
+{
+	struct fs_mount_opts opts = {
+		.cache_blocks = FS_CACHE_DEFAULT_BLOCKS,
+	};
+
+	return fs_mount_ext(diskname, &opts);
+}
+
+/* Mount the file system of diskname, metadata lock held */
+int mount_disk(const char *diskname, const struct fs_mount_opts *opts)
+{
+	char sig_check[ECS150FS_SIG_SIZE + 1];
+
+	if (opts == NULL)
+		return -1;
+
+	/* Open Disk, which fails if one is mounted already */
+	if (opts->ram_blocks) {
+		if (disk_format_ram(opts->ram_blocks) == -1)
+			return -1;
+	} else if (block_disk_open_ext(diskname,
+				       (opts->mmap ? BLOCK_DISK_MMAP : 0) |
+				       (opts->direct ? BLOCK_DISK_DIRECT : 0)) == -1) {
+		return -1;
+	}
+
+	/* Nothing allocated yet, for the failure path */
+	superblock = NULL;
+	fat = NULL;
+	fat_dirty = NULL;
+	free_map = NULL;
+	rdir_blocks = NULL;
+	rdir_blk_index = NULL;
+	rdir_dirty = NULL;
+	rdir_hnext = NULL;
+	rdir_free_map = NULL;
+	rdir_open_count = NULL;
+	rdir_buckets = NULL;
+	rdir_blk_count = 0;
+
+	/* Set up block cache, unless the disk is already in memory */
+	if (cache_init(block_map(0) ? 0 : opts->cache_blocks) == -1) {
+		block_disk_close();
+		return -1;
+	}
+
+	/* Read superblock*/
+	superblock = (superblock_t) malloc(sizeof(uint8_t)*BLOCK_SIZE);
+	if (superblock == NULL || cache_read(0, superblock) == -1)
+		goto fail;
+
+	/* Check signature */
+	memcpy(sig_check,superblock->signature, ECS150FS_SIG_SIZE);
+	sig_check[ECS150FS_SIG_SIZE] = '\0';
+	if (strcmp(ECS150FS_SIG, sig_check) != 0)
+		goto fail;
+
+	/* Check block count */
+	if (block_disk_count() != superblock->total_blk_count)
+		goto fail;
+
+	/* The FAT must have an entry for every data block */
+	if (superblock->data_blk_count >
+	    FAT_PER_BLOCK * superblock->fat_blk_count)
+		goto fail;
+
+	/* Read FAT array */
+	fat = (uint16_t*) malloc(sizeof(uint16_t) * FAT_PER_BLOCK *
+				 superblock->fat_blk_count);
+	if (fat == NULL)
+		goto fail;
+	for (int i = 0; i < superblock->fat_blk_count; i++) {
+		if (cache_read(1 + i, fat + (i * FAT_PER_BLOCK)) == -1)
+			goto fail;
+	}
+
+	/* Nothing to write back yet */
+	fat_dirty = (uint8_t*) calloc(superblock->fat_blk_count, sizeof(uint8_t));
+	if (fat_dirty == NULL)
+		goto fail;
+	superblock_dirty = 0;
+
+	/* Read root directory, its first block then those chained through the
+	FAT */
+	if (rdir_reserve(1 + superblock->rdir_ext_count) == -1)
+		goto fail;
+	rdir_blk_count = 1 + superblock->rdir_ext_count;
+	rdir_count = rdir_blk_count * RDIR_BLOCK_ENTRIES;
+	rdir_blk_index[0] = superblock->data_blk - 1;
+	if (rdir_ext_locate() == -1)
+		goto fail;
+	for (size_t i = 0; i < rdir_blk_count; i++) {
+		rdir_blocks[i] = (file_t) malloc(sizeof(uint8_t)*BLOCK_SIZE);
+		if (rdir_blocks[i] == NULL ||
+		    cache_read(rdir_blk_index[i], rdir_blocks[i]) == -1)
+			goto fail;
+		rdir_dirty[i] = 0;
+	}
+
+	/* Index free FAT entries */
+	if (free_map_build() == -1)
+		goto fail;
+
+	/* Count free space */
+	free_blk_count = superblock->data_blk_count -
+			 fat_count_used(fat, superblock->data_blk_count);
+	free_file_count = 0;
+	for (size_t i = 0; i < rdir_count; i++) {
+		if (rdir_entry(i)->name[0] == '\0')
+			free_file_count++;
+	}
+
+	/* Index files by name */
+	if (rdir_index_build() == -1)
+		goto fail;
+
+	/* Counters start from the mount */
+	memset(&stats, 0, sizeof(struct fs_stats));
+
+	/* Clear Open File Array */
+	memset(open_files,0, sizeof(open_file_t) * FS_OPEN_MAX_COUNT);
+	memset(open_nodes, 0, sizeof(open_node_t) * FS_OPEN_MAX_COUNT);
+	open_free_map = (FS_OPEN_MAX_COUNT == 64) ? ~0ULL :
+			(1ULL << FS_OPEN_MAX_COUNT) - 1;
+	open_file_count = 0;
+
+	return 0;
+
+	/* Leave the disk free for the next mount */
+fail:
+	metadata_free();
+	cache_destroy();
+	block_disk_close();
+	return -1;
+}
+
+int fs_mount_ext(const char *diskname, const struct fs_mount_opts *opts)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&fs_lock);
+	ret = mount_disk(diskname, opts);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+/* Unmount the file system, metadata lock held */
+int umount_disk(void)
+{
+	/* Check for a mounted disk and open files */
+	if (block_disk_count() == -1 || open_file_count != 0)
+		return -1;
+
+	/* Write out the modified metadata */
+	if (metadata_write() == -1)
+		return -1;
+
+	/* Write back cached blocks */
+	if (cache_destroy() == -1)
+		return -1;
+
+	/* Close the Disk */
+	if (block_disk_close() == -1)
+		return -1;
+
+	/* Free metadata structures */
+	metadata_free();
+	return 0;
+}
+
+int fs_umount(void)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&fs_lock);
+	ret = umount_disk();
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_sync(void)
+{
+	int ret = -1;
+
+	pthread_rwlock_wrlock(&fs_lock);
+
+	/* Buffered writes first, then metadata goes through the cache, and
+	everything out to the disk */
+	if (block_disk_count() != -1 && open_flush_all() == 0 &&
+	    metadata_write() == 0 && cache_flush() == 0)
+		ret = block_disk_flush();
+
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_info(void)
+{
+	struct fs_statfs statfs;
+
+	if (fs_statfs(&statfs) == -1)
+		return -1;
+
+	/* FS Info: */
+	printf("FS Info:\n"); 
+
+	/* total_blk_count= */
+	printf("total_blk_count=%zu\n", statfs.total_blk_count);
+
+	/* fat_blk_count= */
+	printf("fat_blk_count=%zu\n", statfs.fat_blk_count);
+
+	/* rdir_blk= */
+	printf("rdir_blk=%zu\n", statfs.rdir_blk);
+
+	/* data_blk= */
+	printf("data_blk=%zu\n", statfs.data_blk);
+
+	/* data_blk_count= */
+	printf("data_blk_count=%zu\n", statfs.data_blk_count);
+
+	/* fat_free_ratio=x/4096 */
+	printf("fat_free_ratio=%zu/%zu\n", statfs.free_blk_count, statfs.data_blk_count);
+
+	/* rdir_free_ratio=x/128 */
+	printf("rdir_free_ratio=%zu/%zu\n", statfs.free_file_count, statfs.file_max_count);
+	
+	return 0;
+}
+
+int fs_statfs(struct fs_statfs *statfs)
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	if (block_disk_count() == -1 || statfs == NULL) {
+		pthread_rwlock_unlock(&fs_lock);
+		return -1;
+	}
+
+	statfs->total_blk_count = superblock->total_blk_count;
+	statfs->fat_blk_count = superblock->fat_blk_count;
+	statfs->rdir_blk = superblock->data_blk - 1;
+	statfs->data_blk = superblock->data_blk;
+	statfs->data_blk_count = superblock->data_blk_count;
+	statfs->free_blk_count = free_blk_count;
+	statfs->file_max_count = rdir_count;
+	statfs->free_file_count = free_file_count;
+	pthread_rwlock_unlock(&fs_lock);
+
+	return 0;
+}
+
+/* Copy the block cache counters to stats */
+void cache_stats_copy(struct fs_cache_stats *stats)
+{
+	struct cache_stats cstats;
+
+	cache_get_stats(&cstats);
+	stats->hits = cstats.hits;
+	stats->misses = cstats.misses;
+	stats->writebacks = cstats.writebacks;
+	stats->evictions = cstats.evictions;
+}
+
+int fs_cache_stats(struct fs_cache_stats *stats)
+{
+	int ret = -1;
+
+	pthread_rwlock_rdlock(&fs_lock);
+	if (block_disk_count() != -1 && stats != NULL) {
+		cache_stats_copy(stats);
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_stats(struct fs_stats *fs_stats)
+{
+	struct block_stats bstats;
+
+	_Static_assert(FS_LAT_BUCKETS == BLOCK_LAT_BUCKETS,
+		       "latency histograms differ in size");
+
+	pthread_rwlock_rdlock(&fs_lock);
+	if (block_disk_count() == -1 || fs_stats == NULL) {
+		pthread_rwlock_unlock(&fs_lock);
+		return -1;
+	}
+
+	/* Plain copy, a counter may lag behind by an operation in progress */
+	*fs_stats = stats;
+	block_get_stats(&bstats);
+	fs_stats->disk_reads = bstats.reads;
+	fs_stats->disk_writes = bstats.writes;
+	fs_stats->disk_bytes_read = bstats.bytes_read;
+	fs_stats->disk_bytes_written = bstats.bytes_written;
+	fs_stats->disk_seeks = bstats.seeks;
+	fs_stats->disk_errors = bstats.errors;
+	memcpy(fs_stats->disk_read_latency, bstats.read_latency,
+	       sizeof(fs_stats->disk_read_latency));
+	memcpy(fs_stats->disk_write_latency, bstats.write_latency,
+	       sizeof(fs_stats->disk_write_latency));
+	cache_stats_copy(&fs_stats->cache);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return 0;
+}
+
+/* Move up to max_blocks blocks in place, metadata lock held */
+int defrag(size_t max_blocks)
+{
+	int32_t *prev;
+	char *blk_buf;
+	uint16_t dst = 1;
+	size_t moved = 0;
+	int ret = 0;
+
+	if (block_disk_count() == -1)
+		return -1;
+
+	/* Chains may have changed since the previous slice */
+	prev = (int32_t*) malloc(sizeof(int32_t) * superblock->data_blk_count);
+	blk_buf = (char*) block_buf_alloc(2);
+	if (prev == NULL || blk_buf == NULL) {
+		free(prev);
+		block_buf_free(blk_buf, 2);
+		return -1;
+	}
+	defrag_build_prev(prev);
+
+	/* Lay files out one after the other, in root directory order, from the
+	first data block on. Blocks already in place cost no I/O */
+	for (size_t i = 0; i < rdir_count && ret == 0; i++) {
+		uint16_t fat_index = rdir_entry(i)->start_index;
+
+		if (rdir_entry(i)->name[0] == '\0' ||
+		    rdir_entry(i)->type == FILE_TYPE_DIR)
+			continue;
+
+		while (fat_index != FAT_EOC) {
+			/* Step over blocks left in place: directories, and files
+			in them */
+			while (fat[dst] != 0 && prev[dst] == DEFRAG_NO_PREV)
+				dst++;
+			if (fat_index != dst) {
+				if (max_blocks && moved == max_blocks) {
+					ret = 1;
+					break;
+				}
+				if (defrag_swap(fat_index, dst, prev, blk_buf) == -1) {
+					ret = -1;
+					break;
+				}
+				moved++;
+			}
+			fat_index = fat[dst++];
+		}
+	}
+
+	/* Root directory blocks and open files find their blocks again */
+	if (moved) {
+		if (rdir_ext_locate() == -1)
+			ret = -1;
+		for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+			if (open_files[i].file == NULL)
+				continue;
+			extent_drop(&open_files[i]);
+			extent_build(&open_files[i]);
+		}
+	}
+
+	block_buf_free(blk_buf, 2);
+	free(prev);
+
+	return ret;
+}
+
+int fs_defrag(size_t max_blocks)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&fs_lock);
+	ret = defrag(max_blocks);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_create(const char *filename)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&fs_lock);
+	ret = file_create(filename, FILE_TYPE_REG);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_delete(const char *filename)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&fs_lock);
+	ret = file_remove(filename, FILE_TYPE_REG);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_mkdir(const char *path)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&fs_lock);
+	ret = file_create(path, FILE_TYPE_DIR);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_rmdir(const char *path)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&fs_lock);
+	ret = file_remove(path, FILE_TYPE_DIR);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+/* Set cursor dir at the beginning of directory path, metadata lock held */
+int dir_open(const char *path, struct fs_dir *dir)
+{
+	char filename[FS_FILENAME_LEN];
+	struct file entry;
+	uint16_t parent;
+
+	if(block_disk_count() == -1 || dir == NULL)
+		return -1;
+
+	dir->dir = DIR_ROOT;
+	dir->pos = 0;
+	dir->key = 0;
+	dir->name[0] = '\0';
+	if (path == NULL || path[strspn(path, "/")] == '\0')
+		return 0;
+
+	if (path_resolve(path, &parent, filename) == -1 ||
+	    dir_lookup(parent, filename, &entry) == -1 ||
+	    entry.type != FILE_TYPE_DIR)
+		return -1;
+	dir->dir = entry.start_index;
+
+	return 0;
+}
+
+int fs_opendir(const char *path, struct fs_dir *dir)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&fs_lock);
+	ret = dir_open(path, dir);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+/* Copy directory entry file to dirent */
+void dirent_fill(struct fs_dirent *dirent, const struct file *file)
+{
+	memcpy(dirent->name, file->name, FS_FILENAME_LEN);
+	dirent->name[FS_FILENAME_LEN - 1] = '\0';
+	dirent->size = file->size;
+	dirent->start_blk = file->start_index;
+	dirent->is_dir = (file->type == FILE_TYPE_DIR);
+}
+
+/* Returns x with its bits in reverse order */
+uint32_t bit_reverse(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+
+	return (x >> 16) | (x << 16);
+}
+
+/* Subdirectory entry along with its listing key */
+typedef struct dir_key {
+	uint32_t key;
+	file_t entry;
+} dir_key_t;
+
+/* Compare listing keys, then names */
+int dir_key_cmp(const void *a, const void *b)
+{
+	const dir_key_t *key_a = a;
+	const dir_key_t *key_b = b;
+
+	if (key_a->key != key_b->key)
+		return (key_a->key < key_b->key) ? -1 : 1;
+
+	return strncmp((char*)key_a->entry->name, (char*)key_b->entry->name,
+		       FS_FILENAME_LEN);
+}
+
+/* Fill entries with the next count entries of cursor dir, metadata lock
+held. Subdirectory entries are listed by key, the bit-reversed hash of their
+name. The low bits of the hash pick the block of an entry, so each block holds
+a range of keys that growing the directory only splits in two, and the key of
+the last entry listed stays a valid cursor */
+int dir_list(struct fs_dir *dir, struct fs_dirent *entries, size_t count)
+{
+	dir_key_t keys[DIR_SLOTS];
+	file_t blk_entries;
+	uint16_t *blks;
+	size_t blk_count;
+	size_t blk_bits;
+	size_t filled = 0;
+	size_t pos = 0;
+	uint16_t blk;
+
+	if(block_disk_count() == -1 || dir == NULL || entries == NULL)
+		return -1;
+
+	stat_add(dir_scans, 1);
+
+	/* Root directory entries are all in memory */
+	if (dir->dir == DIR_ROOT) {
+		for (; filled < count && dir->pos < rdir_count; dir->pos++) {
+			file_t file = rdir_entry(dir->pos);
+
+			stat_add(dir_scan_entries, 1);
+			if (file->name[0] != '\0')
+				dirent_fill(&entries[filled++], file);
+		}
+		return filled;
+	}
+
+	/* Directories have a power of two number of blocks */
+	blk_count = dir_blk_count(dir->dir);
+	blk_bits = __builtin_ctzll(blk_count);
+	blks = (uint16_t*) malloc(sizeof(uint16_t) * blk_count);
+	blk_entries = (file_t) block_buf_alloc(1);
+	if (blks == NULL || blk_entries == NULL) {
+		free(blks);
+		block_buf_free(blk_entries, 1);
+		return -1;
+	}
+	blk = dir->dir;
+	for (size_t i = 0; i < blk_count; i++) {
+		blks[i] = blk;
+		blk = fat[blk];
+	}
+
+	/* Resume in the block of the last entry listed */
+	if (dir->name[0] != '\0' && blk_bits)
+		pos = dir->key >> (32 - blk_bits);
+
+	for (; filled < count && pos < blk_count; pos++) {
+		size_t key_count = 0;
+
+		blk = blks[blk_bits ? bit_reverse(pos) >> (32 - blk_bits) : 0];
+		if (data_block_read(blk, blk_entries) == -1) {
+			free(blks);
+			block_buf_free(blk_entries, 1);
+			return -1;
+		}
+
+		/* Entries of the block past the cursor, in key order */
+		for (size_t slot = 0; slot < DIR_SLOTS; slot++) {
+			dir_key_t *key = &keys[key_count];
+
+			stat_add(dir_scan_entries, 1);
+			if (blk_entries[slot].name[0] == '\0')
+				continue;
+			key->key = bit_reverse(name_hash((char*)blk_entries[slot].name));
+			key->entry = &blk_entries[slot];
+			if (dir->name[0] != '\0' &&
+			    (key->key < dir->key ||
+			     (key->key == dir->key &&
+			      strncmp((char*)key->entry->name, dir->name,
+				      FS_FILENAME_LEN) <= 0)))
+				continue;
+			key_count++;
+		}
+		qsort(keys, key_count, sizeof(dir_key_t), dir_key_cmp);
+
+		for (size_t i = 0; i < key_count && filled < count; i++) {
+			dirent_fill(&entries[filled++], keys[i].entry);
+			dir->key = keys[i].key;
+			memcpy(dir->name, entries[filled - 1].name,
+			       FS_FILENAME_LEN);
+		}
+	}
+
+	free(blks);
+	block_buf_free(blk_entries, 1);
+	return filled;
+}
+
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *entries, size_t count)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&fs_lock);
+	ret = dir_list(dir, entries, count);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_ls(void)
+{
+	struct fs_dirent entries[RDIR_BLOCK_ENTRIES / 4];
+	struct fs_dir dir;
+	int count;
+
+	if (fs_opendir(NULL, &dir) == -1)
+		return -1;
+
+	/* FS Ls: */
+	printf("FS Ls:\n");
+
+	/* List the root directory in batches and print file w/ info */
+	while ((count = fs_readdir(&dir, entries, RDIR_BLOCK_ENTRIES / 4)) > 0) {
+		for (int i = 0; i < count; i++) {
+			/* file: or dir: */
+			printf("%s: %s, ", entries[i].is_dir ? "dir" : "file",
+			       entries[i].name);
+			/* size: */
+			printf("size: %zu, ", entries[i].size);
+			/* data_blk: */
+			printf("data_blk: %zu\n", entries[i].start_blk);
+		}
+	}
+
+	return 0;
+}
+
+/* Close file descriptor fd, metadata lock held shared */
+int file_close(int fd)
+{
+	open_file_t *open_file;
+	pthread_rwlock_t *file_lock;
 
 	/* Check if fd is valid */
 	if (!valid_fd(fd)) 
 		return -1;
 
-	/* Setup blk reading variables */
-	read_file = open_files[fd];
-	byte_rem = read_file.file->size - read_file.offset;	
-	byte_count = (byte_rem < count) ? byte_rem : count;			
-	blk_count = byte_count / BLOCK_SIZE + 1;
-	blk_index = fat_find_index(read_file);
+	/* Wait for accesses in progress on the file */
+	open_file = &open_files[fd];
+	file_lock = open_lock(open_file);
+	pthread_mutex_lock(&fd_locks[fd]);
+	pthread_rwlock_wrlock(file_lock);
+
+	/* Last file descriptor writes the entry back */
+	if (open_file->rdir_index >= 0) {
+		__atomic_fetch_sub(&rdir_open_count[open_file->rdir_index], 1,
+				   __ATOMIC_RELAXED);
+	} else {
+		pthread_mutex_lock(&node_lock);
+		if (--open_nodes[open_file->node].refs == 0)
+			node_write(open_file->node);
+		pthread_mutex_unlock(&node_lock);
+	}
+
+	/* Close file */
+	block_buf_free(open_file->ra_buf, RA_MAX_BLOCKS + 1);
+	block_buf_free(open_file->wb_buf, 1);
+	extent_drop(open_file);
+	memset(open_file,0,sizeof(open_file_t));
+
+	pthread_rwlock_unlock(file_lock);
+	pthread_mutex_unlock(&fd_locks[fd]);
+
+	__atomic_fetch_sub(&open_file_count, 1, __ATOMIC_RELAXED);
+	open_release(fd);
+	return 0;
+}
+
+/* Open the file at path, metadata lock held shared */
+int file_open(const char *path)
+{
+	char name[FS_FILENAME_LEN];
+	struct file entry;
+	open_file_t *open_file;
+	int open_index = -1;
+	int rdir_index = -1;
+	int node = -1;
+	uint16_t dir;
+
+	/* Check if file exists, and is not a directory */
+	if (path_resolve(path, &dir, name) == -1)
+		return -1;
+	if (dir_lookup(dir, name, &entry) == -1 || entry.type != FILE_TYPE_REG)
+		return -1;
+
+	/* Claim a file descriptor, unless there are already too many open
+	files */
+	open_index = open_claim();
+	if (open_index == -1)
+		return -1;
+
+	/* Files outside the root directory share a copy of their entry */
+	if (dir == DIR_ROOT) {
+		rdir_index = rdir_find_file(name);
+		__atomic_fetch_add(&rdir_open_count[rdir_index], 1,
+				   __ATOMIC_RELAXED);
+	} else {
+		pthread_mutex_lock(&node_lock);
+		node = node_find(dir, name);
+		if (node == -1) {
+			for (node = 0; open_nodes[node].refs; node++)
+				;
+			open_nodes[node].entry = entry;
+			open_nodes[node].dir = dir;
+			open_nodes[node].dirty = 0;
+		}
+		open_nodes[node].refs++;
+		pthread_mutex_unlock(&node_lock);
+	}
+
+	open_file = &open_files[open_index];
+	open_file->rdir_index = rdir_index;
+	open_file->node = node;
+	open_file->offset = 0;
+	__atomic_store_n(&open_file->file, (node == -1) ?
+			 rdir_entry(rdir_index) : &open_nodes[node].entry,
+			 __ATOMIC_RELEASE);
+
+	/* Increment open file count */
+	__atomic_fetch_add(&open_file_count, 1, __ATOMIC_RELAXED);
+
+	/* Holes of a sparse file are kept at hand, for reads to skip them */
+	if (open_file->file->flags & FILE_SPARSE) {
+		if (data_block_read(open_file->file->start_index,
+				    &hole_maps[open_index]) == -1) {
+			file_close(open_index);
+			return -1;
+		}
+		open_file->holes = &hole_maps[open_index];
+	}
+
+	/* Map the file blocks, for offsets to be found without walking the FAT */
+	extent_build(open_file);
+
+	return open_index;
+}
+
+int fs_open(const char *filename)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&fs_lock);
+	ret = file_open(filename);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_close(int fd)
+{
+	int ret;
+
+	/* Write out what the descriptor gathered */
+	ret = fd_flush(fd);
+
+	pthread_rwlock_rdlock(&fs_lock);
+	if (file_close(fd) == -1)
+		ret = -1;
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_stat(int fd)
+{
+	int ret = -1;
+
+	/* Count buffered writes in the size */
+	if (fd_flush(fd) == -1)
+		return -1;
+
+	pthread_rwlock_rdlock(&fs_lock);
+
+	/* Check if fd is valid, and return size of file */
+	if (valid_fd(fd))
+		ret = open_files[fd].file->size;
+
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+/* Allocate blocks for size bytes to open_file, metadata lock held */
+int open_allocate(open_file_t *alloc_file, size_t size)
+{
+	file_t file = alloc_file->file;
+	size_t alloc_count;
+	size_t blk_count;
+	size_t added;
+	uint16_t last;
+
+	alloc_count = file_alloc_count(alloc_file);
+	blk_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	/* Already enough blocks */
+	if (blk_count <= alloc_count)
+		return 0;
+
+	/* Check for enough space on disk, so that nothing is left half done */
+	if (blk_count - alloc_count > free_blk_count)
+		return -1;
+
+	last = file_last_block(alloc_file, alloc_count);
+	added = file_chain(alloc_file, last, alloc_count, blk_count - alloc_count);
+	if (added == blk_count - alloc_count)
+		return 0;
+
+	/* Fewer blocks were found than counted free, give them back */
+	if (last == FAT_EOC) {
+		fat_free_chain(file->start_index);
+		file->start_index = FAT_EOC;
+		file_mark_dirty(alloc_file);
+	} else {
+		fat_unchain(last, added);
+	}
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++) {
+		if (open_files[i].file != file)
+			continue;
+		extent_drop(&open_files[i]);
+		extent_build(&open_files[i]);
+	}
+
+	return -1;
+}
+
+int fs_fallocate(int fd, size_t size)
+{
+	int ret = -1;
+
+	pthread_rwlock_wrlock(&fs_lock);
+
+	/* Check if fd is valid */
+	if (valid_fd(fd))
+		ret = open_allocate(&open_files[fd], size);
+
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	int ret = -1;
+
+	/* Gathered writes end at the file offset */
+	if (fd_flush(fd) == -1)
+		return -1;
+
+	pthread_rwlock_rdlock(&fs_lock);
+
+	/* Check if fd is valid, and if offset is within bounds of files, past
+	their end included */
+	if (valid_fd(fd) && offset <= FILE_SIZE_MAX) {
+		pthread_mutex_lock(&fd_locks[fd]);
+		/* Set open file offest */
+		open_files[fd].offset = offset;
+		ret = 0;
+		pthread_mutex_unlock(&fd_locks[fd]);
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+/* Returns the number of bytes of the iovcnt buffers of iov, or -1 if they
+are invalid */
+ssize_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t count = 0;
+
+	if (iov == NULL || iovcnt < 0)
+		return -1;
+
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_base == NULL && iov[i].iov_len)
+			return -1;
+		count += iov[i].iov_len;
+	}
+
+	/* Byte counts are returned as int */
+	if (count > INT32_MAX)
+		return -1;
+
+	return count;
+}
+
+/* Gather the count bytes of iov, less than a block, in the write buffer of fd
+at its file offset. Returns count, or -1 if they have to be written directly
+instead */
+int fd_buffer(int fd, const struct iovec *iov, int iovcnt, size_t count)
+{
+	open_file_t *write_file;
+	size_t offset;
+	int ret = -1;
+
+	pthread_rwlock_rdlock(&fs_lock);
+
+	/* Check if fd is valid */
+	if (!valid_fd(fd)) {
+		pthread_rwlock_unlock(&fs_lock);
+		return -1;
+	}
+
+	write_file = &open_files[fd];
+	pthread_mutex_lock(&fd_locks[fd]);
+	offset = write_file->offset;
+
+	/* Start gathering in a block the file already has, so that writing the
+	buffer out cannot run out of space. Descriptors of a same file do not
+	gather at once, their writes could overlap */
+	if (write_file->wb_len == 0) {
+		if (!write_file->wb_buf)
+			write_file->wb_buf = block_buf_alloc(1);
+		write_file->wb_offset = offset;
+	}
+
+	/* Gather up to the end of the block */
+	if (write_file->wb_buf &&
+	    offset == write_file->wb_offset + write_file->wb_len &&
+	    offset % BLOCK_SIZE + count <= BLOCK_SIZE &&
+	    open_mapped(write_file, offset, count) &&
+	    !open_write_pending(write_file->file, fd)) {
+		char *dst = write_file->wb_buf + write_file->wb_len;
+
+		for (int i = 0; i < iovcnt; i++) {
+			memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+			dst += iov[i].iov_len;
+		}
+		__atomic_store_n(&write_file->wb_len, write_file->wb_len + count,
+				 __ATOMIC_RELAXED);
+		write_file->offset += count;
+		stat_add(buffered_writes, 1);
+		ret = count;
+	}
+
+	pthread_mutex_unlock(&fd_locks[fd]);
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+/* Write the buffers of iov to file descriptor fd, at offset if positional
+or else at its file offset which is then moved past the bytes written */
+int fd_write(int fd, const struct iovec *iov, int iovcnt, size_t offset,
+	     int positional)
+{
+	open_file_t *write_file;
+	pthread_rwlock_t *file_lock;
+	ssize_t count = iov_length(iov, iovcnt);
+	int ret = -1;
+
+	/* Small writes through the file offset are gathered, other writes go
+	after those already gathered */
+	if (!positional && count > 0 && count < BLOCK_SIZE &&
+	    fd_buffer(fd, iov, iovcnt, count) == count)
+		return count;
+	if (fd_flush(fd) == -1)
+		return -1;
+
+	pthread_rwlock_rdlock(&fs_lock);
+
+	/* Check if fd is valid */
+	if (!valid_fd(fd) || count == -1) {
+		pthread_rwlock_unlock(&fs_lock);
+		return -1;
+	}
+
+	/* Writes within the file only change its data blocks */
+	write_file = &open_files[fd];
+	if (!positional) {
+		pthread_mutex_lock(&fd_locks[fd]);
+		offset = write_file->offset;
+	}
+	if (offset + count <= write_file->file->size &&
+	    open_mapped(write_file, offset, count)) {
+		file_lock = open_lock(write_file);
+		pthread_rwlock_wrlock(file_lock);
+		ret = open_write(write_file, iov, count, offset);
+		pthread_rwlock_unlock(file_lock);
+		if (!positional) {
+			if (ret > 0)
+				write_file->offset += ret;
+			pthread_mutex_unlock(&fd_locks[fd]);
+		}
+		pthread_rwlock_unlock(&fs_lock);
+		return ret;
+	}
+	if (!positional)
+		pthread_mutex_unlock(&fd_locks[fd]);
+	pthread_rwlock_unlock(&fs_lock);
+
+	/* Extending the file or filling holes allocates blocks, which needs the
+	file system to itself */
+	pthread_rwlock_wrlock(&fs_lock);
+	if (valid_fd(fd)) {
+		if (!positional)
+			offset = write_file->offset;
+		ret = open_write(write_file, iov, count, offset);
+		if (!positional && ret > 0)
+			write_file->offset += ret;
+	}
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fd_write(fd, &iov, 1, 0, 0);
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fd_write(fd, &iov, 1, offset, 1);
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fd_write(fd, iov, iovcnt, 0, 0);
+}
+
+/* Read byte_count bytes of read_file from offset to the buffers at pos, span
+by span: holes read back as zeros. Blocks are copied from a mapped disk if
+scratch is NULL, or else read as data_chain_read_bytes() does. Sets last to the
+content of the last block read, NULL for a hole, and next to the block
+following it */
+int open_read_spans(const open_file_t *read_file, iov_pos_t *pos,
+		    size_t byte_count, size_t offset, char *scratch,
+		    const char **last, uint16_t *next)
+{
+	*next = FAT_EOC;
+
+	while (byte_count > 0) {
+		size_t byte_offset = offset % BLOCK_SIZE;
+		size_t n = byte_count;
+		size_t span = SIZE_MAX;
+		int hole = 0;
+
+		/* Other files have data blocks up to their size */
+		if (read_file->holes)
+			span = open_span(read_file, offset / BLOCK_SIZE, &hole);
+		if (span < (byte_offset + byte_count + BLOCK_SIZE - 1) / BLOCK_SIZE)
+			n = span * BLOCK_SIZE - byte_offset;
+
+		if (hole) {
+			iov_pos_put(pos, NULL, n);
+			*last = NULL;
+			*next = FAT_EOC;
+		} else {
+			*next = fat_find_block(read_file, offset / BLOCK_SIZE);
+			if (scratch == NULL)
+				data_chain_copy(*next, byte_offset, n, pos);
+			else if (data_chain_read_bytes(next, byte_offset, n, pos,
+						       scratch, last) == -1)
+				return -1;
+		}
+
+		offset += n;
+		byte_count -= n;
+	}
+
+	return 0;
+}
+
+/* Read up to count bytes of read_file from offset into the buffers of iov,
+data lock of the file held. Reads through the file offset also use and update the readahead
+state of the descriptor, with its lock held. Returns -1 if reading the disk
+fails, nothing read being reliable then */
+int open_read(open_file_t *read_file, const struct iovec *iov, size_t count,
+	      size_t offset, int readahead)
+{
+	iov_pos_t pos = { .iov = iov };
+	char *scratch;
+	const char *last_blk;
+	size_t blk_count;
+	uint16_t blk_index;
+	size_t first_blk;
+	size_t byte_count;
+	size_t byte_rem;
+	size_t byte_offset;
 
 	/* Check if offset has reached end of file, zero bytes are read */
-	if (blk_index == 0) 
+	if (offset >= read_file->file->size)
 		return 0;
 
-	/* Allocated block buffer and fill with disk data */
-	blk_buf = (char*) malloc(sizeof(char) * BLOCK_SIZE * blk_count);
-	for (int i = 0; i < blk_count; i++) {
-		data_block_read(blk_index, blk_buf + (BLOCK_SIZE*i));
-		blk_index = fat[blk_index];
+	/* Setup blk reading variables */
+	byte_rem = read_file->file->size - offset;
+	byte_count = (byte_rem < count) ? byte_rem : count;
+	if (byte_count == 0)
+		return 0;
+
+	byte_offset = offset % BLOCK_SIZE;
+	blk_count = (byte_offset + byte_count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	first_blk = offset / BLOCK_SIZE;
+
+	/* Positional reads go straight to the blocks */
+	if (!readahead) {
+		int ret;
+
+		scratch = NULL;
+		if (block_map(superblock->data_blk) == NULL &&
+		    (scratch = (char*) block_buf_alloc(1)) == NULL)
+			return -1;
+		ret = open_read_spans(read_file, &pos, byte_count, offset, scratch,
+				      &last_blk, &blk_index);
+		block_buf_free(scratch, 1);
+		return (ret == -1) ? -1 : byte_count;
+	}
+
+	/* Widen the readahead window while reads are sequential */
+	if (offset == read_file->ra_next) {
+		read_file->ra_window *= 2;
+		if (read_file->ra_window < RA_MIN_BLOCKS)
+			read_file->ra_window = RA_MIN_BLOCKS;
+		if (read_file->ra_window > RA_MAX_BLOCKS)
+			read_file->ra_window = RA_MAX_BLOCKS;
+	} else {
+		read_file->ra_window /= 2;
+		if (read_file->ra_window < RA_MIN_BLOCKS)
+			read_file->ra_window = 0;
+		read_file->ra_count = 0;
+	}
+	read_file->ra_next = offset + byte_count;
+
+	/* Serve from the prefetched blocks */
+	if (read_file->ra_count && first_blk >= read_file->ra_start &&
+	    first_blk + blk_count <= read_file->ra_start + read_file->ra_count) {
+		iov_pos_put(&pos, read_file->ra_buf +
+			    (first_blk - read_file->ra_start) * BLOCK_SIZE +
+			    byte_offset, byte_count);
+		stat_add(readahead_hits, 1);
+		return byte_count;
+	}
+
+	/* Copy straight from a mapped disk */
+	if (block_map(superblock->data_blk) != NULL) {
+		if (open_read_spans(read_file, &pos, byte_count, offset, NULL,
+				    &last_blk, &blk_index) == -1)
+			return -1;
+		return byte_count;
 	}
 
-	/* Copy needed data from blk_buf */
-	byte_offset = read_file.offset % BLOCK_SIZE;
-	memcpy(buf, (blk_buf + byte_offset), byte_count);
+	/* Read whole blocks straight into the buffers */
+	scratch = (char*) block_buf_alloc(1);
+	if (scratch == NULL)
+		return -1;
+	if (open_read_spans(read_file, &pos, byte_count, offset, scratch,
+			    &last_blk, &blk_index) == -1) {
+		block_buf_free(scratch, 1);
+		return -1;
+	}
 
-	/* Modify offset */
-	read_file.offset += byte_count;
+	/* Prefetch the next blocks, after the last one read which the next
+	read probably starts in, up to the next hole */
+	if (read_file->ra_window && last_blk) {
+		size_t file_blk_count = (read_file->file->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		size_t ra_count = file_blk_count - (first_blk + blk_count);
+		int hole = 0;
+		size_t span = SIZE_MAX;
+
+		if (read_file->holes)
+			span = open_span(read_file, first_blk + blk_count, &hole);
+		if (hole)
+			ra_count = 0;
+		if (ra_count > span)
+			ra_count = span;
+		if (ra_count > read_file->ra_window)
+			ra_count = read_file->ra_window;
+		if (!read_file->ra_buf)
+			read_file->ra_buf = block_buf_alloc(RA_MAX_BLOCKS + 1);
+
+		/* A failed prefetch is only a missed one */
+		if (read_file->ra_buf) {
+			memcpy(read_file->ra_buf, last_blk, BLOCK_SIZE);
+			if (ra_count && data_chain_read(&blk_index, ra_count,
+							read_file->ra_buf +
+							BLOCK_SIZE) == -1)
+				ra_count = 0;
+			read_file->ra_start = first_blk + blk_count - 1;
+			read_file->ra_count = ra_count + 1;
+		}
+	}
+	block_buf_free(scratch, 1);
 
 	return byte_count;
 }
 
+/* Fill the buffers of iov from file descriptor fd, from offset if positional
+or else from its file offset which is then moved past the bytes read */
+int fd_read(int fd, const struct iovec *iov, int iovcnt, size_t offset,
+	    int positional)
+{
+	open_file_t *read_file;
+	pthread_rwlock_t *file_lock;
+	ssize_t count = iov_length(iov, iovcnt);
+	int ret;
+
+	/* Buffered writes are read back from the file */
+	if (fd_flush(fd) == -1)
+		return -1;
+
+	pthread_rwlock_rdlock(&fs_lock);
+
+	/* Check if fd is valid */
+	if (!valid_fd(fd) || count == -1) {
+		pthread_rwlock_unlock(&fs_lock);
+		return -1;
+	}
+
+	/* Readers of a same file, or of different files, go in parallel. So do
+	positional readers of a same descriptor */
+	read_file = &open_files[fd];
+	file_lock = open_lock(read_file);
+	if (!positional) {
+		pthread_mutex_lock(&fd_locks[fd]);
+		offset = read_file->offset;
+	}
+	pthread_rwlock_rdlock(file_lock);
+	ret = open_read(read_file, iov, count, offset, !positional);
+	pthread_rwlock_unlock(file_lock);
+	if (!positional) {
+		if (ret > 0)
+			read_file->offset += ret;
+		pthread_mutex_unlock(&fd_locks[fd]);
+	}
+
+	pthread_rwlock_unlock(&fs_lock);
+
+	return ret;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fd_read(fd, &iov, 1, 0, 0);
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fd_read(fd, &iov, 1, offset, 1);
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fd_read(fd, iov, iovcnt, 0, 0);
+}
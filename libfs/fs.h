@@ -2,16 +2,132 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
-#define FS_FILE_MAX_COUNT 128
+/**
+ * Maximum number of files in the root directory. The root directory starts
+ * with one block of 128 entries, and more blocks are added as it fills up
+ */
+#define FS_FILE_MAX_COUNT 65536
+
+/** Maximum path length (including the NULL character) */
+#define FS_PATH_MAX_LEN 256
 
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Number of blocks cached by fs_mount() */
+#define FS_CACHE_DEFAULT_BLOCKS 64
+
+/** Mount options, see fs_mount_ext() */
+struct fs_mount_opts {
+	/* Size of the block cache in blocks (0 disables caching) */
+	size_t cache_blocks;
+	/* Map the virtual disk file in memory (the block cache is not used) */
+	int mmap;
+	/* Bypass the host's page cache, cannot be combined with mmap */
+	int direct;
+	/* Number of data blocks of a new file system kept in memory only, or 0
+	 * to mount the virtual disk file */
+	size_t ram_blocks;
+};
+
+/** File system geometry and usage, see fs_statfs() */
+struct fs_statfs {
+	/* Blocks of the virtual disk */
+	size_t total_blk_count;
+	/* FAT blocks */
+	size_t fat_blk_count;
+	/* Root directory block */
+	size_t rdir_blk;
+	/* First data block, and number of data blocks */
+	size_t data_blk;
+	size_t data_blk_count;
+	/* Data blocks not allocated to any file */
+	size_t free_blk_count;
+	/* Root directory entries, and those not holding a file */
+	size_t file_max_count;
+	size_t free_file_count;
+};
+
+/** Directory entry, see fs_readdir() */
+struct fs_dirent {
+	/* File name, NULL-terminated */
+	char name[FS_FILENAME_LEN];
+	/* File size in bytes */
+	size_t size;
+	/* First data block of the file */
+	size_t start_blk;
+	/* Non-zero if the entry is a directory */
+	int is_dir;
+};
+
+/** Directory cursor, see fs_opendir() */
+struct fs_dir {
+	/* First block of the directory, or the root directory */
+	size_t dir;
+	/* Next entry slot to look at, in the root directory */
+	size_t pos;
+	/* Key and name of the last entry listed, in a subdirectory */
+	size_t key;
+	char name[FS_FILENAME_LEN];
+};
+
+/** Number of buckets in latency histograms, see &struct fs_stats */
+#define FS_LAT_BUCKETS 24
+
+/** Block cache counters, see fs_cache_stats() */
+struct fs_cache_stats {
+	/* Block accesses served from the cache */
+	size_t hits;
+	/* Block accesses that went to the virtual disk */
+	size_t misses;
+	/* Dirty blocks written back to the virtual disk */
+	size_t writebacks;
+	/* Cached blocks dropped to make room for other blocks */
+	size_t evictions;
+};
+
+/**
+ * File system counters, see fs_stats()
+ *
+ * Latency histograms are log2-bucketed in microseconds: bucket 0 counts disk
+ * operations that took less than 2us, bucket i those that took from 2^i to
+ * 2^(i+1) us, and the last bucket everything slower.
+ */
+struct fs_stats {
+	/* Disk operations, and bytes they transferred */
+	size_t disk_reads;
+	size_t disk_writes;
+	size_t disk_bytes_read;
+	size_t disk_bytes_written;
+	/* Disk operations not starting where the previous one ended */
+	size_t disk_seeks;
+	/* Failed disk operations */
+	size_t disk_errors;
+	/* Disk latency histograms */
+	size_t disk_read_latency[FS_LAT_BUCKETS];
+	size_t disk_write_latency[FS_LAT_BUCKETS];
+	/* FAT chains followed, and entries followed along them */
+	size_t fat_walks;
+	size_t fat_walk_entries;
+	/* Searches for a free FAT entry, and free-space bitmap words looked at */
+	size_t fat_scans;
+	size_t fat_scan_entries;
+	/* Root directory searches, and entries looked at */
+	size_t dir_scans;
+	size_t dir_scan_entries;
+	/* Reads served from the readahead buffer of their file descriptor */
+	size_t readahead_hits;
+	/* Writes gathered in the write buffer of their file descriptor */
+	size_t buffered_writes;
+	/* Block cache */
+	struct fs_cache_stats cache;
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,11 +136,44 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * Every function can be called from several threads at once. Reads, and writes
+ * that stay within the size of a file, run in parallel with each other, except
+ * for writes to a same file; calls creating or deleting files, or allocating
+ * blocks, run one at a time.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_ext - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options
+ *
+ * Same as fs_mount(), but with the behavior described by @opts. fs_mount() is
+ * equivalent to a call with a block cache of %FS_CACHE_DEFAULT_BLOCKS blocks.
+ *
+ * Writes are kept in the block cache and only reach the virtual disk when
+ * their block is evicted or when the file system is unmounted.
+ *
+ * If @opts->mmap is set, the virtual disk file is mapped in memory: the mapping
+ * takes the place of the block cache, and fs_read() copies data straight from
+ * it into the caller's buffer.
+ *
+ * If @opts->direct is set, the virtual disk file is accessed with O_DIRECT, so
+ * that the block cache is the only copy of the file system's blocks in memory.
+ *
+ * If @opts->ram_blocks is set, @diskname is ignored: an empty file system with
+ * @opts->ram_blocks data blocks is created on a RAM disk and mounted. Its
+ * content is lost when it is unmounted.
+ *
+ * Return: -1 if @opts is NULL, if virtual disk file @diskname cannot be opened,
+ * if @opts->ram_blocks is too large for a file system, if the block cache
+ * cannot be allocated, or if no valid file system can be located. 0 otherwise.
+ */
+int fs_mount_ext(const char *diskname, const struct fs_mount_opts *opts);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -36,6 +185,19 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write file system out to disk
+ *
+ * Write the metadata modified since the file system was mounted or last
+ * synced, as well as every block still held in the block cache, and make sure
+ * the virtual disk stores them. fs_umount() writes modified metadata too, but
+ * only fs_sync() makes a checkpoint of a file system that stays mounted.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if writing failed. 0
+ * otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -45,14 +207,68 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_statfs - Get information about file system
+ * @statfs: Structure to be filled with the information
+ *
+ * Fill @statfs with the information fs_info() displays. Free counts are kept
+ * up to date as files are created, written and deleted, so this is cheap
+ * enough to be called at any time.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @statfs is NULL. 0
+ * otherwise.
+ */
+int fs_statfs(struct fs_statfs *statfs);
+
+/**
+ * fs_cache_stats - Get block cache counters
+ * @stats: Structure to be filled with the counters
+ *
+ * Fill @stats with the block cache counters accumulated since the file system
+ * was mounted.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @stats is NULL. 0
+ * otherwise.
+ */
+int fs_cache_stats(struct fs_cache_stats *stats);
+
+/**
+ * fs_stats - Get file system counters
+ * @stats: Structure to be filled with the counters
+ *
+ * Fill @stats with the disk, file system and block cache counters accumulated
+ * since the file system was mounted.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @stats is NULL. 0
+ * otherwise.
+ */
+int fs_stats(struct fs_stats *stats);
+
+/**
+ * fs_defrag - Defragment file system
+ * @max_blocks: Maximum number of blocks to move, 0 for no limit
+ *
+ * Move data blocks so that files are stored in contiguous blocks, one after
+ * the other in root directory order, from the first data block on. At most
+ * @max_blocks blocks are moved, so that defragmentation can be spread over
+ * several calls, with other operations in between. Files can be open.
+ * Directory blocks, and files in subdirectories, are not moved.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if defragmentation
+ * failed. 1 if some blocks still have to be moved. 0 otherwise.
+ */
+int fs_defrag(size_t max_blocks);
+
 /**
  * fs_create - Create a new file
- * @filename: File name
+ * @filename: File path
  *
- * Create a new and empty file named @filename in the root directory of the
- * mounted file system. String @filename must be NULL-terminated and its total
- * length cannot exceed %FS_FILENAME_LEN characters (including the NULL
- * character).
+ * Create a new and empty file at path @filename in the mounted file system.
+ * Path components are separated by '/' and all but the last one must be
+ * existing directories; a path with a single component names a file of the
+ * root directory. String @filename must be NULL-terminated, its total length
+ * cannot exceed %FS_PATH_MAX_LEN characters and each of its components
+ * %FS_FILENAME_LEN characters (including the NULL character).
  *
  * Return: -1 if @filename is invalid, if a file named @filename already exists,
  * or if string @filename is too long, or if the root directory already contains
@@ -62,20 +278,75 @@ int fs_create(const char *filename);
 
 /**
  * fs_delete - Delete a file
- * @filename: File name
+ * @filename: File path
  *
- * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * Delete the file at path @filename from the mounted file system.
  *
  * Return: -1 if @filename is invalid, if there is no file named @filename to
- * delete, or if file @filename is currently open. 0 otherwise.
+ * delete, if @filename is a directory, or if file @filename is currently open.
+ * 0 otherwise.
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_mkdir - Create a new directory
+ * @path: Directory path
+ *
+ * Create a new and empty directory at @path, following the same rules as
+ * fs_create(). Directories take one block to start with and double in size
+ * whenever one of their blocks fills up.
+ *
+ * Return: -1 if @path is invalid, if a file named @path already exists, or if
+ * there is no space left for the directory. 0 otherwise.
+ */
+int fs_mkdir(const char *path);
+
+/**
+ * fs_rmdir - Delete a directory
+ * @path: Directory path
+ *
+ * Delete the empty directory at @path.
+ *
+ * Return: -1 if @path is invalid, if there is no directory named @path, or if
+ * the directory still contains files. 0 otherwise.
+ */
+int fs_rmdir(const char *path);
+
+/**
+ * fs_opendir - Start listing a directory
+ * @path: Directory path, or NULL for the root directory
+ * @dir: Cursor to be set at the first entry of the directory
+ *
+ * Set cursor @dir at the beginning of directory @path, for fs_readdir() to
+ * list its entries. The cursor belongs to the caller and does not need to be
+ * released. Files created or deleted while listing may or may not be returned,
+ * other files are returned once, even if the directory grows in between.
+ *
+ * Return: -1 if no underlying virtual disk was opened, if @dir is NULL, or if
+ * there is no directory named @path. 0 otherwise.
+ */
+int fs_opendir(const char *path, struct fs_dir *dir);
+
+/**
+ * fs_readdir - List directory entries
+ * @dir: Cursor set by fs_opendir()
+ * @entries: Array to be filled with directory entries
+ * @count: Number of entries @entries can hold
+ *
+ * Fill @entries with up to @count entries of the directory of cursor @dir,
+ * starting at its position, and move the cursor past them.
+ *
+ * Return: -1 if no underlying virtual disk was opened or if @dir or @entries is
+ * NULL. Otherwise return the number of entries filled, 0 once the whole
+ * directory has been listed.
+ */
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *entries, size_t count);
+
 /**
  * fs_ls - List files on file system
  *
- * List information about the files located in the root directory.
+ * List information about the files located in the root directory, as returned
+ * by fs_readdir().
  *
  * Return: -1 if no underlying virtual disk was opened. 0 otherwise.
  */
@@ -83,9 +354,9 @@ int fs_ls(void);
 
 /**
  * fs_open - Open a file
- * @filename: File name
+ * @filename: File path
  *
- * Open file named @filename for reading and writing, and return the
+ * Open file at path @filename for reading and writing, and return the
  * corresponding file descriptor. The file descriptor is a non-negative integer
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
@@ -94,8 +365,8 @@ int fs_ls(void);
  * simultaneously.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * if @filename is a directory, or if there are already %FS_OPEN_MAX_COUNT files
+ * currently open. Otherwise, return the file descriptor.
  */
 int fs_open(const char *filename);
 
@@ -103,10 +374,11 @@ int fs_open(const char *filename);
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd, after writing out the writes gathered in its
+ * buffer.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if its gathered writes could not be written. 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -121,6 +393,22 @@ int fs_close(int fd);
  */
 int fs_stat(int fd);
 
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @size: Number of bytes to reserve
+ *
+ * Reserve enough data blocks for the file pointed by file descriptor @fd to
+ * hold @size bytes, as contiguous as the free space allows. The size of the
+ * file does not change: the reserved blocks are used by the following writes
+ * instead of blocks allocated on the fly, and are freed when the file is
+ * deleted. Holes left by writing past the end of the file are not filled.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if the disk does not have enough free blocks. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t size);
+
 /**
  * fs_lseek - Set file offset
  * @fd: File descriptor
@@ -130,9 +418,12 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * The file offset can be set beyond the end of the file, in which case the next
+ * write leaves a hole in the file (see fs_write()).
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open), or if @offset is out of bounds (beyond the end of the file). 0
- * otherwise.
+ * open), or if @offset is larger than the maximum file size (INT32_MAX bytes).
+ * 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -152,8 +443,20 @@ int fs_lseek(int fd, size_t offset);
  * as many bytes as possible. The number of written bytes can therefore be
  * smaller than @count (it can even be 0 if there is no more space on disk).
  *
+ * When the file offset is beyond the end of the file, the bytes in between form
+ * a hole: they read back as zeros but use no data block until they are written.
+ * A file keeps track of its holes in one extra data block, and a file with too
+ * many of them has its new gaps filled with zeroed blocks instead.
+ *
+ * Writes smaller than a block are gathered in a buffer of @fd, up to the end of
+ * the block, and written out at once when the next write does not follow them,
+ * before the file is read or its size queried, when @fd is seeked or closed, or
+ * when the file system is synced.
+ *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually written.
+ * open), or if writing to the disk fails before any byte is written. Otherwise
+ * return the number of bytes actually written, which stops short of @count if
+ * writing to the disk fails.
  */
 int fs_write(int fd, void *buf, size_t count);
 
@@ -169,12 +472,83 @@ int fs_write(int fd, void *buf, size_t count);
  *
  * The number of bytes read can be smaller than @count if there are less than
  * @count bytes until the end of the file (it can even be 0 if the file offset
- * is at the end of the file). The file offset of the file descriptor is
- * implicitly incremented by the number of bytes that were actually read.
+ * is at the end of the file). Holes in the file read as zeros, without
+ * accessing the disk. The file offset of the file descriptor is implicitly
+ * incremented by the number of bytes that were actually read.
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually read.
+ * open), or if reading from the disk fails. Otherwise return the number of
+ * bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), but write at @offset instead of the file offset of @fd,
+ * which is neither used nor modified. Several threads can therefore write
+ * through a same file descriptor without calling fs_lseek().
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if writing to the disk fails before any byte is written. Otherwise
+ * return the number of bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), but read from @offset instead of the file offset of @fd,
+ * which is neither used nor modified. Positional reads through a same file
+ * descriptor run in parallel. They do not prefetch, since they are not
+ * expected to be sequential.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if reading from the disk fails. Otherwise return the number of
+ * bytes actually read, 0 if @offset is at or past the end of the file.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write several buffers to a file
+ * @fd: File descriptor
+ * @iov: Buffers to write in the file, one after the other
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write() with the @iovcnt buffers of @iov laid end to end, in one
+ * call. Whole blocks are written straight from the buffers, consecutive ones
+ * at once. Only the blocks that do not lie whole in one buffer are gathered
+ * first.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @iov is NULL. Otherwise return the number of bytes actually
+ * written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Buffers to be filled with data, one after the other
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read() with the @iovcnt buffers of @iov laid end to end, in one
+ * call. Whole blocks are read straight into the buffers, consecutive ones at
+ * once. Only the blocks that do not lie whole in one buffer are scattered
+ * afterwards.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if @iov is NULL. Otherwise return the number of bytes actually
+ * read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
 #endif /* _FS_H */
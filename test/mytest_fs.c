@@ -1,9 +1,11 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -13,6 +15,46 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
+/* Block cache of the cache test, smaller than the file it writes */
+#define CACHE_BLOCKS 8
+#define CACHE_FILE_SIZE (20 * 4096)
+
+/* File added by the backend test, ending in a partial block */
+#define BACKEND_SIZE 10000
+#define BACKEND_RAM_BLOCKS 100
+
+/* Files written by the free counts test */
+#define STATFS_SIZE_A 10000
+#define STATFS_SIZE_B (5 * 4096)
+
+/* Blocks of each of the two files the defragmentation test interleaves */
+#define FRAG_BLOCKS 8
+
+/* Files created in a directory, more than its first block holds */
+#define DIR_FILES 200
+
+/* Files created in the root directory, listed a few at a time */
+#define ROOT_FILES 40
+
+/* Files created in a directory while listing it, per batch listed */
+#define GROW_FILES 20
+
+/* Threads sharing a file, each owning a region not aligned on blocks */
+#define MT_THREADS 4
+#define MT_REGION 3000
+#define MT_ITERS 1000
+
+/* File written by the positional and vectored I/O tests */
+#define IO_SIZE 5000
+#define IOV_SIZE (10 + 2 * 4096 + 4096)
+
+/* Small writes gathered by the write buffer */
+#define WB_WRITES 50
+#define WB_LEN 10
+
+/* Gaps left in a sparse file, more than its hole map holds */
+#define SPARSE_GAPS 519
+
 #define test_fs_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
 
@@ -269,6 +311,844 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_cache(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_mount_opts opts = { .cache_blocks = CACHE_BLOCKS };
+	static char expect[CACHE_FILE_SIZE], buf[CACHE_FILE_SIZE];
+	struct fs_cache_stats before, after;
+	int fs_fd;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	for (size_t i = 0; i < sizeof(expect); i++)
+		expect[i] = (char)(i * 7 + i / 4096);
+
+	if (fs_mount_ext(t_arg->argv[0], &opts))
+		die("Cannot mount diskname");
+	fs_create("cache");
+	fs_fd = fs_open("cache");
+	printf("write: %d\n", fs_write(fs_fd, expect, sizeof(expect)));
+
+	/* Rewriting more single blocks than the cache holds evicts dirty ones */
+	fs_cache_stats(&before);
+	for (int i = CACHE_FILE_SIZE / 4096 - 1; i >= 0; i--) {
+		expect[i * 4096] = 'c';
+		fs_lseek(fs_fd, i * 4096);
+		fs_write(fs_fd, expect + i * 4096, 4096);
+	}
+	fs_cache_stats(&after);
+	printf("evictions: %s\n", after.evictions > before.evictions ? "yes" : "no");
+	printf("writebacks: %s\n",
+	       after.writebacks > before.writebacks ? "yes" : "no");
+
+	/* The last block rewritten is still cached */
+	fs_lseek(fs_fd, 0);
+	fs_read(fs_fd, buf, 4096);
+	fs_cache_stats(&before);
+	fs_lseek(fs_fd, 0);
+	fs_read(fs_fd, buf, 4096);
+	fs_cache_stats(&after);
+	printf("repeated read hits: %s\n", after.hits > before.hits ? "yes" : "no");
+	fs_close(fs_fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	/* Everything reached the disk, read it through a single block */
+	opts.cache_blocks = 1;
+	if (fs_mount_ext(t_arg->argv[0], &opts))
+		die("Cannot mount diskname");
+	fs_fd = fs_open("cache");
+	memset(buf, 0, sizeof(buf));
+	ret = fs_read(fs_fd, buf, sizeof(buf));
+	printf("after remount: %d %s\n", ret,
+	       memcmp(buf, expect, sizeof(expect)) ? "wrong" : "ok");
+
+	/* A block still dirty in the cache is written back on unmount */
+	memcpy(expect, "cached", 6);
+	fs_lseek(fs_fd, 0);
+	fs_write(fs_fd, expect, 4096);
+	fs_close(fs_fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	opts.cache_blocks = 0;
+	if (fs_mount_ext(t_arg->argv[0], &opts))
+		die("Cannot mount diskname");
+	fs_fd = fs_open("cache");
+	memset(buf, 0, sizeof(buf));
+	fs_read(fs_fd, buf, 4096);
+	printf("written back on unmount: %s\n",
+	       memcmp(buf, expect, 4096) ? "wrong" : "ok");
+	fs_close(fs_fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Add, cat and rm a file on the backend opts selects, remounting in between
+unless the file system lives in memory */
+void backend_run(const char *diskname, const char *name,
+		 const struct fs_mount_opts *opts)
+{
+	static char expect[BACKEND_SIZE], buf[BACKEND_SIZE + 100];
+	int fs_fd;
+	int ret;
+
+	for (size_t i = 0; i < sizeof(expect); i++)
+		expect[i] = (char)(i * 13 + 5);
+
+	if (fs_mount_ext(diskname, opts))
+		die("Cannot mount %s", name);
+	fs_create("backend");
+	fs_fd = fs_open("backend");
+	printf("%s add: %d\n", name, fs_write(fs_fd, expect, sizeof(expect)));
+	fs_close(fs_fd);
+
+	if (!opts->ram_blocks) {
+		if (fs_umount() || fs_mount_ext(diskname, opts))
+			die("Cannot remount %s", name);
+	}
+	fs_fd = fs_open("backend");
+	memset(buf, 0, sizeof(buf));
+	ret = fs_read(fs_fd, buf, sizeof(buf));
+	printf("%s cat: %d %s\n", name, ret,
+	       memcmp(buf, expect, sizeof(expect)) ? "wrong" : "ok");
+	fs_close(fs_fd);
+
+	if (!opts->ram_blocks) {
+		if (fs_umount() || fs_mount_ext(diskname, opts))
+			die("Cannot remount %s", name);
+	}
+	ret = fs_delete("backend");
+	printf("%s rm: %d %s\n", name, ret,
+	       fs_open("backend") == -1 ? "gone" : "still there");
+
+	if (fs_umount())
+		die("Cannot unmount %s", name);
+}
+
+void thread_fs_backends(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_mount_opts opts;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	opts = (struct fs_mount_opts){ .cache_blocks = FS_CACHE_DEFAULT_BLOCKS };
+	backend_run(t_arg->argv[0], "file", &opts);
+	opts = (struct fs_mount_opts){ .mmap = 1 };
+	backend_run(t_arg->argv[0], "mmap", &opts);
+	opts = (struct fs_mount_opts){ .cache_blocks = FS_CACHE_DEFAULT_BLOCKS,
+				       .direct = 1 };
+	backend_run(t_arg->argv[0], "direct", &opts);
+	opts = (struct fs_mount_opts){ .cache_blocks = FS_CACHE_DEFAULT_BLOCKS,
+				       .ram_blocks = BACKEND_RAM_BLOCKS };
+	backend_run(NULL, "ram", &opts);
+}
+
+/* Mount a disk twice, the second mount must leave the first one working */
+void thread_fs_remount(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	printf("mount again: %d\n", fs_mount(t_arg->argv[0]));
+	printf("create: %d\n", fs_create("remount"));
+	printf("delete: %d\n", fs_delete("remount"));
+	printf("umount: %d\n", fs_umount());
+}
+
+/* Print the free counts of fs_statfs() as fs_info() does */
+void statfs_print(const char *step)
+{
+	struct fs_statfs statfs;
+
+	fs_statfs(&statfs);
+	printf("%s: fat_free_ratio=%zu/%zu rdir_free_ratio=%zu/%zu\n", step,
+	       statfs.free_blk_count, statfs.data_blk_count,
+	       statfs.free_file_count, statfs.file_max_count);
+}
+
+void thread_fs_statfs(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static char buf[STATFS_SIZE_B];
+	int fs_fd;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	statfs_print("mounted");
+
+	fs_create("a");
+	statfs_print("after create");
+	fs_fd = fs_open("a");
+	fs_write(fs_fd, buf, STATFS_SIZE_A);
+	fs_close(fs_fd);
+	statfs_print("after write");
+
+	fs_create("b");
+	fs_fd = fs_open("b");
+	fs_write(fs_fd, buf, STATFS_SIZE_B);
+	fs_close(fs_fd);
+	statfs_print("after second file");
+
+	fs_delete("a");
+	statfs_print("after delete");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_frag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char buf[4096];
+	int fd_a, fd_b;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	/* Appending to both files in turn interleaves their blocks */
+	fs_create("frag-a");
+	fs_create("frag-b");
+	fd_a = fs_open("frag-a");
+	fd_b = fs_open("frag-b");
+	for (int i = 0; i < FRAG_BLOCKS; i++) {
+		memset(buf, 'a' + i, sizeof(buf));
+		fs_write(fd_a, buf, sizeof(buf));
+		memset(buf, 'A' + i, sizeof(buf));
+		fs_write(fd_b, buf, sizeof(buf));
+	}
+	fs_close(fd_a);
+	fs_close(fd_b);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_runs(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_mount_opts opts = { .cache_blocks = 0 };
+	struct fs_stats before, after;
+	struct fs_statfs statfs;
+	static char buf[FRAG_BLOCKS * 4096];
+	int fs_fd;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <filename>");
+
+	if (fs_mount_ext(t_arg->argv[0], &opts))
+		die("Cannot mount diskname");
+
+	/* Without a cache, every run of consecutive blocks is one disk read */
+	fs_fd = fs_open(t_arg->argv[1]);
+	fs_stats(&before);
+	fs_read(fs_fd, buf, sizeof(buf));
+	fs_stats(&after);
+	fs_close(fs_fd);
+	fs_statfs(&statfs);
+	printf("runs: %zu\n", after.disk_reads - before.disk_reads);
+	printf("free: %zu\n", statfs.free_blk_count);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* List directory path count entries at a time. Returns the number of files
+named file<i> listed, or -1 if one is listed twice */
+int dir_list_count(const char *path, size_t count)
+{
+	struct fs_dirent entries[count];
+	char seen[DIR_FILES] = { 0 };
+	struct fs_dir dir;
+	int listed = 0;
+	int ret;
+
+	if (fs_opendir(path, &dir))
+		return -1;
+
+	while ((ret = fs_readdir(&dir, entries, count)) > 0) {
+		for (int i = 0; i < ret; i++) {
+			int n;
+
+			if (sscanf(entries[i].name, "file%d", &n) != 1 ||
+			    n < 0 || n >= DIR_FILES)
+				continue;
+			if (seen[n])
+				return -1;
+			seen[n] = 1;
+			listed++;
+		}
+	}
+
+	return listed;
+}
+
+/* List directory path count entries at a time, creating GROW_FILES files
+named new<i> after each batch and counting them in created. Returns the number
+of files named file<i> listed, or -1 if one is listed twice */
+int dir_list_growing(const char *path, size_t count, int *created)
+{
+	struct fs_dirent entries[count];
+	char seen[DIR_FILES] = { 0 };
+	char filename[FS_PATH_MAX_LEN];
+	struct fs_dir dir;
+	int listed = 0;
+	int ret;
+
+	*created = 0;
+
+	if (fs_opendir(path, &dir))
+		return -1;
+
+	while ((ret = fs_readdir(&dir, entries, count)) > 0) {
+		for (int i = 0; i < ret; i++) {
+			int n;
+
+			if (sscanf(entries[i].name, "file%d", &n) != 1 ||
+			    n < 0 || n >= DIR_FILES)
+				continue;
+			if (seen[n])
+				return -1;
+			seen[n] = 1;
+			listed++;
+		}
+		for (int i = 0; i < GROW_FILES; i++) {
+			sprintf(filename, "%s/new%d", path, *created);
+			if (fs_create(filename) == 0)
+				(*created)++;
+		}
+	}
+
+	return listed;
+}
+
+void thread_fs_dirs(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_statfs start, before, after;
+	char path[FS_PATH_MAX_LEN];
+	char buf[16];
+	int fs_fd;
+	int i, ok, ret, created;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	fs_statfs(&start);
+
+	/* Nested paths, with repeated and trailing slashes */
+	ret = fs_mkdir("a");
+	ret |= fs_mkdir("a/b");
+	ret |= fs_mkdir("/a//c/");
+	printf("mkdir nested: %d\n", ret);
+	printf("create nested: %d\n", fs_create("a/b/f"));
+	fs_fd = fs_open("a/b/f");
+	fs_write(fs_fd, "nested", 6);
+	fs_close(fs_fd);
+	memset(buf, 0, sizeof(buf));
+	fs_fd = fs_open("//a///b//f");
+	ret = fs_read(fs_fd, buf, sizeof(buf));
+	printf("read through //: %d %s\n", ret, buf);
+	fs_close(fs_fd);
+	printf("create in missing directory: %d\n", fs_create("a/x/f"));
+	printf("open directory: %d\n", fs_open("a/b"));
+
+	/* Directory growing past its first block */
+	fs_statfs(&before);
+	for (i = 0; i < DIR_FILES; i++) {
+		sprintf(path, "a/c/file%d", i);
+		if (fs_create(path))
+			break;
+	}
+	fs_statfs(&after);
+	printf("created: %d\n", i);
+	printf("directory grew: %s\n",
+	       before.free_blk_count - after.free_blk_count > DIR_FILES ?
+	       "yes" : "no");
+
+	/* Listing a few entries at a time */
+	printf("listed: %d\n", dir_list_count("a/c", 7));
+
+	/* Entries shifted back over deleted ones must still be found */
+	for (i = 0; i < DIR_FILES; i += 3) {
+		sprintf(path, "a/c/file%d", i);
+		fs_delete(path);
+	}
+	ok = 1;
+	for (i = 0; i < DIR_FILES; i++) {
+		sprintf(path, "a/c/file%d", i);
+		fs_fd = fs_open(path);
+		if ((fs_fd >= 0) != (i % 3 != 0))
+			ok = 0;
+		if (fs_fd >= 0)
+			fs_close(fs_fd);
+	}
+	printf("lookups after delete: %s\n", ok ? "ok" : "wrong");
+	printf("listed after delete: %d\n", dir_list_count("a/c", 7));
+
+	/* Files created while listing grow the directory, the others are still
+	listed once each */
+	fs_mkdir("a/g");
+	for (i = 0; i < DIR_FILES / 2; i++) {
+		sprintf(path, "a/g/file%d", i);
+		fs_create(path);
+	}
+	fs_statfs(&before);
+	ret = dir_list_growing("a/g", 7, &created);
+	fs_statfs(&after);
+	printf("listed while growing: %d\n", ret);
+	printf("grew while listing: %s\n",
+	       before.free_blk_count - after.free_blk_count > (size_t)created ?
+	       "yes" : "no");
+	for (i = 0; i < DIR_FILES; i++) {
+		sprintf(path, "a/g/file%d", i);
+		fs_delete(path);
+	}
+	for (i = 0; ; i++) {
+		sprintf(path, "a/g/new%d", i);
+		if (fs_delete(path))
+			break;
+	}
+	printf("rmdir grown: %d\n", fs_rmdir("a/g"));
+
+	/* The root directory, too, is listed in batches */
+	for (i = 0; i < ROOT_FILES; i++) {
+		sprintf(path, "file%d", i);
+		fs_create(path);
+	}
+	printf("root listed: %d\n", dir_list_count(NULL, 3));
+	for (i = 0; i < ROOT_FILES; i++) {
+		sprintf(path, "file%d", i);
+		fs_delete(path);
+	}
+
+	/* Only empty directories can be deleted */
+	printf("rmdir non-empty: %d\n", fs_rmdir("a/c"));
+	for (i = 0; i < DIR_FILES; i++) {
+		sprintf(path, "a/c/file%d", i);
+		fs_delete(path);
+	}
+	printf("rmdir emptied: %d\n", fs_rmdir("a/c"));
+	fs_delete("a/b/f");
+	ret = fs_rmdir("a/b");
+	ret |= fs_rmdir("a");
+	printf("rmdir nested: %d\n", ret);
+
+	fs_statfs(&after);
+	printf("blocks leaked: %zu\n", start.free_blk_count - after.free_blk_count);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void mt_fill(char *buf, size_t len, int thread, int iter)
+{
+	for (size_t i = 0; i < len; i++)
+		buf[i] = (char)(thread * 31 + iter + i);
+}
+
+void *mt_worker(void *arg)
+{
+	int thread = (int)(intptr_t)arg;
+	char expect[MT_REGION], buf[MT_REGION];
+	size_t offset = (size_t)thread * MT_REGION;
+	char filename[FS_FILENAME_LEN];
+	int fs_fd, tmp_fd;
+	intptr_t errors = 0;
+
+	fs_fd = fs_open("shared");
+	if (fs_fd < 0)
+		return (void *)(intptr_t)MT_ITERS;
+
+	sprintf(filename, "tmp%d", thread);
+	for (int iter = 0; iter < MT_ITERS; iter++) {
+		/* Own region of the shared file */
+		mt_fill(expect, MT_REGION, thread, iter);
+		if (fs_pwrite(fs_fd, expect, MT_REGION, offset) != MT_REGION ||
+		    fs_pread(fs_fd, buf, MT_REGION, offset) != MT_REGION ||
+		    memcmp(buf, expect, MT_REGION)) {
+			errors++;
+			continue;
+		}
+
+		/* Private file, created and deleted while others run */
+		if (fs_create(filename)) {
+			errors++;
+			continue;
+		}
+		tmp_fd = fs_open(filename);
+		if (tmp_fd < 0 ||
+		    fs_write(tmp_fd, expect, iter + 1) != iter + 1 ||
+		    fs_pread(tmp_fd, buf, MT_REGION, 0) != iter + 1 ||
+		    memcmp(buf, expect, iter + 1))
+			errors++;
+		if (tmp_fd >= 0)
+			fs_close(tmp_fd);
+		if (fs_delete(filename))
+			errors++;
+	}
+
+	fs_close(fs_fd);
+	return (void *)errors;
+}
+
+void thread_fs_threads(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_statfs start, end;
+	pthread_t threads[MT_THREADS];
+	char expect[MT_REGION], buf[MT_REGION];
+	intptr_t errors = 0;
+	int intact = 1;
+	int fs_fd;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	fs_statfs(&start);
+
+	if (fs_create("shared"))
+		die("Cannot create file");
+	fs_fd = fs_open("shared");
+	fs_fallocate(fs_fd, MT_THREADS * MT_REGION);
+
+	/* Positional writes cannot start past the end of the file */
+	memset(buf, 0, MT_REGION);
+	for (int i = 0; i < MT_THREADS; i++)
+		fs_write(fs_fd, buf, MT_REGION);
+
+	for (int i = 0; i < MT_THREADS; i++)
+		if (pthread_create(&threads[i], NULL, mt_worker,
+				   (void *)(intptr_t)i))
+			die("Cannot create thread");
+	for (int i = 0; i < MT_THREADS; i++) {
+		void *ret;
+
+		pthread_join(threads[i], &ret);
+		errors += (intptr_t)ret;
+	}
+	printf("thread errors: %ld\n", (long)errors);
+
+	/* Each region holds the last pattern its thread wrote */
+	for (int i = 0; i < MT_THREADS; i++) {
+		mt_fill(expect, MT_REGION, i, MT_ITERS - 1);
+		if (fs_pread(fs_fd, buf, MT_REGION, (size_t)i * MT_REGION) !=
+		    MT_REGION || memcmp(buf, expect, MT_REGION))
+			intact = 0;
+	}
+	printf("regions intact: %s\n", intact ? "yes" : "no");
+	printf("file size: %d\n", fs_stat(fs_fd));
+
+	fs_close(fs_fd);
+	fs_delete("shared");
+	fs_statfs(&end);
+	printf("blocks leaked: %zu\n", start.free_blk_count - end.free_blk_count);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_pio(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char expect[IO_SIZE + 100], buf[IO_SIZE + 100];
+	int fs_fd;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	fs_create("pio");
+	fs_fd = fs_open("pio");
+	mt_fill(expect, sizeof(expect), 0, 0);
+
+	printf("pwrite: %d\n", fs_pwrite(fs_fd, expect, IO_SIZE, 0));
+	printf("size: %d\n", fs_stat(fs_fd));
+
+	/* Across a block boundary */
+	memcpy(expect + 4090, "0123456789", 10);
+	printf("pwrite across blocks: %d\n",
+	       fs_pwrite(fs_fd, expect + 4090, 10, 4090));
+	memset(buf, 0, sizeof(buf));
+	ret = fs_pread(fs_fd, buf, 10, 4090);
+	printf("pread across blocks: %d %s\n", ret,
+	       memcmp(buf, "0123456789", 10) ? "wrong" : "ok");
+
+	/* Extending the file */
+	printf("pwrite at end: %d\n",
+	       fs_pwrite(fs_fd, expect + IO_SIZE, 100, IO_SIZE));
+	printf("size: %d\n", fs_stat(fs_fd));
+	ret = fs_pread(fs_fd, buf, sizeof(buf), 0);
+	printf("pread all: %d %s\n", ret,
+	       memcmp(buf, expect, sizeof(expect)) ? "wrong" : "ok");
+	printf("pread past end: %d\n", fs_pread(fs_fd, buf, 100, IO_SIZE + 50));
+	printf("pread at end: %d\n", fs_pread(fs_fd, buf, 100, IO_SIZE + 100));
+
+	/* The file offset was left alone */
+	ret = fs_read(fs_fd, buf, 10);
+	printf("read: %d %s\n", ret, memcmp(buf, expect, 10) ? "wrong" : "ok");
+
+	fs_close(fs_fd);
+	printf("pread closed fd: %d\n", fs_pread(fs_fd, buf, 10, 0));
+	printf("pwrite closed fd: %d\n", fs_pwrite(fs_fd, buf, 10, 0));
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_iov(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static char expect[IOV_SIZE], buf[IOV_SIZE + 1000];
+	struct iovec iov[4];
+	int fs_fd;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	fs_create("iov");
+	fs_fd = fs_open("iov");
+	mt_fill(expect, sizeof(expect), 1, 0);
+
+	/* Blocks straddling buffers, whole blocks in one, an empty buffer */
+	iov[0] = (struct iovec){ expect, 10 };
+	iov[1] = (struct iovec){ expect + 10, 2 * 4096 };
+	iov[2] = (struct iovec){ expect + 10 + 2 * 4096, 0 };
+	iov[3] = (struct iovec){ expect + 10 + 2 * 4096, 4096 };
+	printf("writev: %d\n", fs_writev(fs_fd, iov, 4));
+	printf("size: %d\n", fs_stat(fs_fd));
+	ret = fs_pread(fs_fd, buf, sizeof(buf), 0);
+	printf("pread: %d %s\n", ret,
+	       memcmp(buf, expect, IOV_SIZE) ? "wrong" : "ok");
+
+	/* Split differently, block aligned then with room to spare */
+	memset(buf, 0, sizeof(buf));
+	fs_lseek(fs_fd, 0);
+	iov[0] = (struct iovec){ buf, 4096 };
+	iov[1] = (struct iovec){ buf + 4096, 2 * 4096 };
+	iov[2] = (struct iovec){ buf + 3 * 4096, sizeof(buf) - 3 * 4096 };
+	ret = fs_readv(fs_fd, iov, 3);
+	printf("readv: %d %s\n", ret,
+	       memcmp(buf, expect, IOV_SIZE) ? "wrong" : "ok");
+	printf("readv at end: %d\n", fs_readv(fs_fd, iov, 3));
+
+	/* From the middle of the file */
+	memset(buf, 0, sizeof(buf));
+	fs_lseek(fs_fd, 4000);
+	iov[0] = (struct iovec){ buf, 100 };
+	iov[1] = (struct iovec){ buf + 100, 4096 };
+	ret = fs_readv(fs_fd, iov, 2);
+	printf("readv middle: %d %s\n", ret,
+	       memcmp(buf, expect + 4000, 100 + 4096) ? "wrong" : "ok");
+
+	printf("readv no buffers: %d\n", fs_readv(fs_fd, NULL, 1));
+	printf("writev no buffers: %d\n", fs_writev(fs_fd, NULL, 1));
+
+	fs_close(fs_fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Number of writes gathered since the last call */
+size_t wb_gathered(void)
+{
+	static size_t last;
+	struct fs_stats stats;
+	size_t gathered;
+
+	fs_stats(&stats);
+	gathered = stats.buffered_writes - last;
+	last = stats.buffered_writes;
+	return gathered;
+}
+
+void thread_fs_wbuf(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char expect[WB_WRITES * WB_LEN + 2 * WB_LEN], buf[sizeof(expect)];
+	size_t len = WB_WRITES * WB_LEN;
+	int fs_fd, other_fd;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	fs_create("wbuf");
+	fs_fd = fs_open("wbuf");
+	other_fd = fs_open("wbuf");
+	mt_fill(expect, sizeof(expect), 2, 0);
+	wb_gathered();
+
+	for (int i = 0; i < WB_WRITES; i++)
+		fs_write(fs_fd, expect + i * WB_LEN, WB_LEN);
+	printf("gathered: %zu\n", wb_gathered());
+
+	/* Read back through the same descriptor and through another one */
+	ret = fs_pread(fs_fd, buf, sizeof(buf), 0);
+	printf("pread: %d %s\n", ret, memcmp(buf, expect, len) ? "wrong" : "ok");
+	fs_write(fs_fd, expect + len, WB_LEN);
+	len += WB_LEN;
+	ret = fs_read(other_fd, buf, sizeof(buf));
+	printf("read other fd: %d %s\n", ret,
+	       memcmp(buf, expect, len) ? "wrong" : "ok");
+	fs_close(other_fd);
+
+	/* Seeking writes the buffer out, so the next write starts a new one */
+	fs_write(fs_fd, expect + len, WB_LEN);
+	len += WB_LEN;
+	fs_lseek(fs_fd, 0);
+	memcpy(expect, "XY", 2);
+	fs_write(fs_fd, "XY", 2);
+	printf("gathered: %zu\n", wb_gathered());
+	printf("size: %d\n", fs_stat(fs_fd));
+
+	/* Closing writes the buffer out too */
+	fs_lseek(fs_fd, 4);
+	memcpy(expect + 4, "ZZ", 2);
+	fs_write(fs_fd, "ZZ", 2);
+	fs_close(fs_fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	fs_fd = fs_open("wbuf");
+	memset(buf, 0, sizeof(buf));
+	ret = fs_read(fs_fd, buf, sizeof(buf));
+	printf("after remount: %d %s\n", ret,
+	       memcmp(buf, expect, len) ? "wrong" : "ok");
+	fs_close(fs_fd);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Data blocks in use */
+size_t used_blocks(void)
+{
+	struct fs_statfs statfs;
+
+	fs_statfs(&statfs);
+	return statfs.data_blk_count - statfs.free_blk_count;
+}
+
+/* Returns 1 if the len bytes of buf are zeros */
+int all_zeros(const char *buf, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		if (buf[i])
+			return 0;
+
+	return 1;
+}
+
+void thread_fs_sparse(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static char buf[11 * 4096];
+	size_t size = 10 * 4096 + 104;
+	size_t start;
+	int fs_fd;
+	int ret, ok;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+	start = used_blocks();
+
+	/* Seeking past the end then writing leaves a hole */
+	fs_create("sparse");
+	fs_fd = fs_open("sparse");
+	fs_write(fs_fd, "head", 4);
+	printf("lseek past end: %d\n", fs_lseek(fs_fd, size - 4));
+	printf("write: %d\n", fs_write(fs_fd, "tail", 4));
+	printf("size: %d\n", fs_stat(fs_fd));
+	printf("blocks used: %zu\n", used_blocks() - start);
+
+	ret = fs_pread(fs_fd, buf, sizeof(buf), 0);
+	printf("read: %d %s\n", ret,
+	       !memcmp(buf, "head", 4) && all_zeros(buf + 4, size - 8) &&
+	       !memcmp(buf + size - 4, "tail", 4) ? "ok" : "wrong");
+
+	/* Filling part of the hole */
+	printf("pwrite in hole: %d\n", fs_pwrite(fs_fd, "mid", 3, 5 * 4096 + 7));
+	printf("blocks used: %zu\n", used_blocks() - start);
+	ret = fs_pread(fs_fd, buf, sizeof(buf), 0);
+	printf("read: %d %s\n", ret,
+	       all_zeros(buf + 4, 5 * 4096 + 3) &&
+	       !memcmp(buf + 5 * 4096 + 7, "mid", 3) &&
+	       all_zeros(buf + 5 * 4096 + 10, size - 5 * 4096 - 14) ?
+	       "ok" : "wrong");
+
+	/* Filling the rest drops the hole map */
+	memset(buf, 0, sizeof(buf));
+	fs_pwrite(fs_fd, buf, 9 * 4096, 4096);
+	printf("blocks used: %zu\n", used_blocks() - start);
+
+	fs_close(fs_fd);
+	fs_delete("sparse");
+	printf("blocks leaked: %zu\n", used_blocks() - start);
+
+	/* Gaps past the first HOLE_MAP_RUNS get zeroed blocks */
+	fs_create("gaps");
+	fs_fd = fs_open("gaps");
+	for (size_t i = 0; i <= SPARSE_GAPS; i++)
+		fs_pwrite(fs_fd, "x", 1, 2 * i * 4096);
+	printf("size: %d\n", fs_stat(fs_fd));
+	printf("blocks used: %zu\n", used_blocks() - start);
+
+	ok = 1;
+	for (size_t i = 0; i <= SPARSE_GAPS; i++) {
+		if (fs_pread(fs_fd, buf, 2 * 4096, 2 * i * 4096) < 1 ||
+		    buf[0] != 'x' ||
+		    !all_zeros(buf + 1, i < SPARSE_GAPS ? 2 * 4096 - 1 : 0))
+			ok = 0;
+	}
+	printf("read: %s\n", ok ? "ok" : "wrong");
+
+	/* A whole hole can still be filled with the map full */
+	printf("pwrite in hole: %d\n", fs_pwrite(fs_fd, "y", 1, 4096));
+	printf("blocks used: %zu\n", used_blocks() - start);
+
+	fs_close(fs_fd);
+	fs_delete("gaps");
+	printf("blocks leaked: %zu\n", used_blocks() - start);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -277,6 +1157,38 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_files(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char filename[FS_FILENAME_LEN];
+	char buf[32];
+	int count;
+	int i;
+	int fs_fd;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <count>");
+
+	count = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	/* Each file holds a line naming it */
+	for (i = 0; i < count; i++) {
+		sprintf(filename, "f%d", i);
+		if (fs_create(filename))
+			break;
+		fs_fd = fs_open(filename);
+		fs_write(fs_fd, buf, sprintf(buf, "file %d\n", i));
+		fs_close(fs_fd);
+	}
+	printf("created: %d\n", i);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -287,7 +1199,20 @@ static struct {
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "unmount", thread_fs_unmount }
+	{ "unmount", thread_fs_unmount },
+	{ "cache",	thread_fs_cache },
+	{ "backends",	thread_fs_backends },
+	{ "remount",	thread_fs_remount },
+	{ "statfs",	thread_fs_statfs },
+	{ "frag",	thread_fs_frag },
+	{ "runs",	thread_fs_runs },
+	{ "files",	thread_fs_files },
+	{ "dirs",	thread_fs_dirs },
+	{ "threads",	thread_fs_threads },
+	{ "pio",	thread_fs_pio },
+	{ "iov",	thread_fs_iov },
+	{ "wbuf",	thread_fs_wbuf },
+	{ "sparse",	thread_fs_sparse }
 };
 
 void usage(char *program)
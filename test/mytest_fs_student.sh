@@ -339,6 +339,454 @@ run_fs_create_multiple() {
 	add_answer "${sub}"
 }
 
+run_fs_cache() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./mytest_fs.x cache test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	line_array+=("$(select_line "${STDOUT}" "5")")
+	line_array+=("$(select_line "${STDOUT}" "6")")
+	local corr_array=()
+	corr_array+=("write: 81920")
+	corr_array+=("evictions: yes")
+	corr_array+=("writebacks: yes")
+	corr_array+=("repeated read hits: yes")
+	corr_array+=("after remount: 81920 ok")
+	corr_array+=("written back on unmount: ok")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_backends() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./mytest_fs.x backends test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	line_array+=("$(select_line "${STDOUT}" "5")")
+	line_array+=("$(select_line "${STDOUT}" "6")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "8")")
+	line_array+=("$(select_line "${STDOUT}" "9")")
+	line_array+=("$(select_line "${STDOUT}" "10")")
+	line_array+=("$(select_line "${STDOUT}" "11")")
+	line_array+=("$(select_line "${STDOUT}" "12")")
+	local corr_array=()
+	corr_array+=("file add: 10000")
+	corr_array+=("file cat: 10000 ok")
+	corr_array+=("file rm: 0 gone")
+	corr_array+=("mmap add: 10000")
+	corr_array+=("mmap cat: 10000 ok")
+	corr_array+=("mmap rm: 0 gone")
+	corr_array+=("direct add: 10000")
+	corr_array+=("direct cat: 10000 ok")
+	corr_array+=("direct rm: 0 gone")
+	corr_array+=("ram add: 10000")
+	corr_array+=("ram cat: 10000 ok")
+	corr_array+=("ram rm: 0 gone")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_remount() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./mytest_fs.x remount test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	local corr_array=()
+	corr_array+=("mount again: -1")
+	corr_array+=("create: 0")
+	corr_array+=("delete: 0")
+	corr_array+=("umount: 0")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_statfs() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./mytest_fs.x statfs test.fs
+	local counts="${STDOUT}"
+	# The reference implementation counts free entries from scratch
+	run_test ./fs_ref.x info test.fs
+	local ref="$(select_line "${STDOUT}" "7") $(select_line "${STDOUT}" "8")"
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${counts}" "1")")
+	line_array+=("$(select_line "${counts}" "2")")
+	line_array+=("$(select_line "${counts}" "3")")
+	line_array+=("$(select_line "${counts}" "4")")
+	line_array+=("$(select_line "${counts}" "5")")
+	line_array+=("$(select_line "${counts}" "5")")
+	local corr_array=()
+	corr_array+=("mounted: fat_free_ratio=99/100 rdir_free_ratio=128/128")
+	corr_array+=("after create: fat_free_ratio=98/100 rdir_free_ratio=127/128")
+	corr_array+=("after write: fat_free_ratio=96/100 rdir_free_ratio=127/128")
+	corr_array+=("after second file: fat_free_ratio=91/100 rdir_free_ratio=126/128")
+	corr_array+=("after delete: fat_free_ratio=94/100 rdir_free_ratio=127/128")
+	corr_array+=("after delete: ${ref}")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_defrag() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./mytest_fs.x frag test.fs
+
+	run_test ./test_fs.x cat test.fs frag-a
+	local cat_a=$(md5sum <<< "${STDOUT}")
+	run_test ./test_fs.x cat test.fs frag-b
+	local cat_b=$(md5sum <<< "${STDOUT}")
+	run_test ./mytest_fs.x runs test.fs frag-a
+	local before="${STDOUT}"
+
+	# In slices, so that blocks are moved over several calls
+	run_tool ./test_fs.x defrag test.fs 3
+
+	run_test ./mytest_fs.x runs test.fs frag-a
+	local after_a="${STDOUT}"
+	run_test ./mytest_fs.x runs test.fs frag-b
+	local after_b="${STDOUT}"
+
+	local line_array=()
+	line_array+=("$(select_line "${before}" "1")")
+	line_array+=("$(select_line "${after_a}" "1")")
+	line_array+=("$(select_line "${after_b}" "1")")
+	line_array+=("$(select_line "${after_a}" "2")")
+	run_test ./test_fs.x cat test.fs frag-a
+	line_array+=("frag-a: $(md5sum <<< "${STDOUT}")")
+	run_test ./test_fs.x cat test.fs frag-b
+	line_array+=("frag-b: $(md5sum <<< "${STDOUT}")")
+	rm -f test.fs
+	local corr_array=()
+	corr_array+=("runs: 8")
+	corr_array+=("runs: 1")
+	corr_array+=("runs: 1")
+	corr_array+=("$(select_line "${before}" "2")")
+	corr_array+=("frag-a: ${cat_a}")
+	corr_array+=("frag-b: ${cat_b}")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_many_files() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 1000
+	echo "from the reference" > test-file-1
+	run_tool ./fs_ref.x add test.fs test-file-1
+	rm -f test-file-1
+
+	local line_array=()
+	# Images written by the reference implementation still mount
+	run_test ./test_fs.x ls test.fs
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	# The root directory grows past its first block
+	run_test ./mytest_fs.x files test.fs 300
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	# Its extra blocks are found again after a remount
+	run_test ./test_fs.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "8")")
+	run_test ./test_fs.x ls test.fs
+	line_array+=("listed: $(grep -c "^file:" <<< "${STDOUT}")")
+	line_array+=("$(select_line "${STDOUT}" "302")")
+	run_test ./test_fs.x cat test.fs f299
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	run_test ./test_fs.x cat test.fs test-file-1
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	rm -f test.fs
+	local corr_array=()
+	corr_array+=("file: test-file-1, size: 19, data_blk: 1")
+	corr_array+=("created: 300")
+	corr_array+=("fat_free_ratio=696/1000")
+	corr_array+=("rdir_free_ratio=83/384")
+	corr_array+=("listed: 301")
+	corr_array+=("file: f299, size: 9, data_blk: 303")
+	corr_array+=("file 299")
+	corr_array+=("from the reference")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_dirs() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 1000
+	run_test ./mytest_fs.x dirs test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	line_array+=("$(select_line "${STDOUT}" "5")")
+	line_array+=("$(select_line "${STDOUT}" "6")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "8")")
+	line_array+=("$(select_line "${STDOUT}" "9")")
+	line_array+=("$(select_line "${STDOUT}" "10")")
+	line_array+=("$(select_line "${STDOUT}" "11")")
+	line_array+=("$(select_line "${STDOUT}" "12")")
+	line_array+=("$(select_line "${STDOUT}" "13")")
+	line_array+=("$(select_line "${STDOUT}" "14")")
+	line_array+=("$(select_line "${STDOUT}" "15")")
+	line_array+=("$(select_line "${STDOUT}" "16")")
+	line_array+=("$(select_line "${STDOUT}" "17")")
+	line_array+=("$(select_line "${STDOUT}" "18")")
+	local corr_array=()
+	corr_array+=("mkdir nested: 0")
+	corr_array+=("create nested: 0")
+	corr_array+=("read through //: 6 nested")
+	corr_array+=("create in missing directory: -1")
+	corr_array+=("open directory: -1")
+	corr_array+=("created: 200")
+	corr_array+=("directory grew: yes")
+	corr_array+=("listed: 200")
+	corr_array+=("lookups after delete: ok")
+	corr_array+=("listed after delete: 133")
+	corr_array+=("listed while growing: 100")
+	corr_array+=("grew while listing: yes")
+	corr_array+=("rmdir grown: 0")
+	corr_array+=("root listed: 40")
+	corr_array+=("rmdir non-empty: -1")
+	corr_array+=("rmdir emptied: 0")
+	corr_array+=("rmdir nested: 0")
+	corr_array+=("blocks leaked: 0")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_threads() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 500
+	run_test ./mytest_fs.x threads test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	local corr_array=()
+	corr_array+=("thread errors: 0")
+	corr_array+=("regions intact: yes")
+	corr_array+=("file size: 12000")
+	corr_array+=("blocks leaked: 0")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_pio() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./mytest_fs.x pio test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	line_array+=("$(select_line "${STDOUT}" "5")")
+	line_array+=("$(select_line "${STDOUT}" "6")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "8")")
+	line_array+=("$(select_line "${STDOUT}" "9")")
+	line_array+=("$(select_line "${STDOUT}" "10")")
+	line_array+=("$(select_line "${STDOUT}" "11")")
+	line_array+=("$(select_line "${STDOUT}" "12")")
+	local corr_array=()
+	corr_array+=("pwrite: 5000")
+	corr_array+=("size: 5000")
+	corr_array+=("pwrite across blocks: 10")
+	corr_array+=("pread across blocks: 10 ok")
+	corr_array+=("pwrite at end: 100")
+	corr_array+=("size: 5100")
+	corr_array+=("pread all: 5100 ok")
+	corr_array+=("pread past end: 50")
+	corr_array+=("pread at end: 0")
+	corr_array+=("read: 10 ok")
+	corr_array+=("pread closed fd: -1")
+	corr_array+=("pwrite closed fd: -1")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_iov() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./mytest_fs.x iov test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	line_array+=("$(select_line "${STDOUT}" "5")")
+	line_array+=("$(select_line "${STDOUT}" "6")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "8")")
+	local corr_array=()
+	corr_array+=("writev: 12298")
+	corr_array+=("size: 12298")
+	corr_array+=("pread: 12298 ok")
+	corr_array+=("readv: 12298 ok")
+	corr_array+=("readv at end: 0")
+	corr_array+=("readv middle: 4196 ok")
+	corr_array+=("readv no buffers: -1")
+	corr_array+=("writev no buffers: -1")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_wbuf() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./mytest_fs.x wbuf test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	line_array+=("$(select_line "${STDOUT}" "5")")
+	line_array+=("$(select_line "${STDOUT}" "6")")
+	local corr_array=()
+	corr_array+=("gathered: 50")
+	corr_array+=("pread: 500 ok")
+	corr_array+=("read other fd: 510 ok")
+	corr_array+=("gathered: 3")
+	corr_array+=("size: 520")
+	corr_array+=("after remount: 520 ok")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
+run_fs_sparse() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 1000
+	run_test ./mytest_fs.x sparse test.fs
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "1")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "4")")
+	line_array+=("$(select_line "${STDOUT}" "5")")
+	line_array+=("$(select_line "${STDOUT}" "6")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "8")")
+	line_array+=("$(select_line "${STDOUT}" "9")")
+	line_array+=("$(select_line "${STDOUT}" "10")")
+	line_array+=("$(select_line "${STDOUT}" "11")")
+	line_array+=("$(select_line "${STDOUT}" "12")")
+	line_array+=("$(select_line "${STDOUT}" "13")")
+	line_array+=("$(select_line "${STDOUT}" "14")")
+	line_array+=("$(select_line "${STDOUT}" "15")")
+	line_array+=("$(select_line "${STDOUT}" "16")")
+	local corr_array=()
+	corr_array+=("lseek past end: 0")
+	corr_array+=("write: 4")
+	corr_array+=("size: 41064")
+	corr_array+=("blocks used: 3")
+	corr_array+=("read: 41064 ok")
+	corr_array+=("pwrite in hole: 3")
+	corr_array+=("blocks used: 4")
+	corr_array+=("read: 41064 ok")
+	corr_array+=("blocks used: 11")
+	corr_array+=("blocks leaked: 0")
+	corr_array+=("size: 4251649")
+	corr_array+=("blocks used: 529")
+	corr_array+=("read: ok")
+	corr_array+=("pwrite in hole: 1")
+	corr_array+=("blocks used: 530")
+	corr_array+=("blocks leaked: 0")
+
+	sub=0
+	compare_output_lines line_array[@] corr_array[@] "1"
+
+	inc_total
+	add_answer "${sub}"
+}
+
 #
 # Run tests
 #
@@ -349,6 +797,30 @@ run_tests() {
 	# Phase 2
 	run_fs_simple_create
 	run_fs_create_multiple
+	# Block cache
+	run_fs_cache
+	# Block device backends
+	run_fs_backends
+	# Mounting twice
+	run_fs_remount
+	# Free counts
+	run_fs_statfs
+	# Defragmentation
+	run_fs_defrag
+	# Large root directory
+	run_fs_many_files
+	# Subdirectories
+	run_fs_dirs
+	# Concurrency
+	run_fs_threads
+	# Positional I/O
+	run_fs_pio
+	# Vectored I/O
+	run_fs_iov
+	# Write buffer
+	run_fs_wbuf
+	# Sparse files
+	run_fs_sparse
 }
 
 make_fs() {